@@ -0,0 +1,50 @@
+#pragma once
+#include <cstdint>
+#include <cstdio>
+#include <sys/mman.h>
+
+// A bump allocator over one up-front address space reservation. Pages are
+// only committed by the OS when first touched, so reserving for the worst
+// case costs nothing until it is used, and everything is released at once.
+struct memory_arena {
+    uint8_t* base;
+    size_t size;
+    size_t used;
+};
+
+memory_arena make_arena(size_t size)
+{
+    memory_arena arena = {};
+    if (size) {
+        void* data = mmap(nullptr, size, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (data != MAP_FAILED) {
+            arena.base = (uint8_t*)data;
+            arena.size = size;
+        } else {
+            fprintf(stderr, "ERROR: Unable to reserve %llu bytes.\n", size);
+        }
+    }
+    return arena;
+}
+
+void* push_size(memory_arena* arena, size_t size, size_t alignment)
+{
+    void* result = nullptr;
+    size_t at = (arena->used + (alignment - 1)) & ~(alignment - 1);
+    if (at + size <= arena->size) {
+        result = arena->base + at;
+        arena->used = at + size;
+    }
+    return result;
+}
+
+#define push_struct(arena, type) (type*)push_size(arena, sizeof(type), alignof(type))
+
+void release_arena(memory_arena* arena)
+{
+    if (arena->base) {
+        munmap(arena->base, arena->size);
+    }
+    *arena = {};
+}
@@ -0,0 +1,317 @@
+#pragma once
+#include "platform_metrics.h"
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <sys/mman.h>
+#include <unistd.h>
+
+struct buffer {
+    size_t count;
+    uint8_t* data;
+};
+
+#define CONSTANT_STRING(string) \
+    buffer { sizeof(string) - 1, (uint8_t*)(string) }
+
+bool is_in_bounds(buffer source, uint64_t at)
+{
+    bool result = (at < source.count);
+    return result;
+}
+
+bool are_equal(buffer a, buffer b)
+{
+    if (a.count != b.count) {
+        return false;
+    }
+
+    for (uint64_t i = 0; i < a.count; ++i) {
+        if (a.data[i] != b.data[i]) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+// NOTE: buffers from allocate_buffer and map_buffer are followed by at least
+// BUFFER_PADDING zero bytes that are not part of them. A scanner can read the
+// byte just past the end without checking the bounds first: a zero continues
+// no token, so every scanning loop stops there on its own.
+constexpr size_t BUFFER_PADDING = 64;
+
+buffer allocate_buffer(size_t count)
+{
+    buffer res = {};
+    res.data = (uint8_t*)malloc(count + BUFFER_PADDING);
+    if (res.data) {
+        memset(res.data + count, 0, BUFFER_PADDING);
+        res.count = count;
+    } else {
+        fprintf(stderr, "ERROR: Unable to allocate %llu bytes.\n", count);
+    }
+
+    return res;
+}
+
+// NOTE: buffers handed out by map_buffer are backed by the page cache rather
+// than the heap. They are recorded here so that free_buffer can release any
+// buffer without the caller having to remember where it came from.
+// NOTE: a reserved region also has one bit per page that is committed.
+struct mapped_region {
+    uint8_t* base;
+    size_t size;
+    uint64_t* commit_bits;
+};
+
+constexpr uint32_t MAX_MAPPED_REGIONS = 16;
+static mapped_region global_mapped_regions[MAX_MAPPED_REGIONS];
+
+// NOTE: nullptr finds a free slot.
+mapped_region* find_mapped_region(uint8_t const* base)
+{
+    for (uint32_t i = 0; i < MAX_MAPPED_REGIONS; ++i) {
+        if (global_mapped_regions[i].base == base) {
+            return global_mapped_regions + i;
+        }
+    }
+    return nullptr;
+}
+
+buffer map_buffer(int fd, size_t count, bool populate)
+{
+    buffer res = {};
+    mapped_region* region = find_mapped_region(nullptr);
+
+    if (region && count) {
+        // NOTE: the file is mapped over the front of a zero-filled anonymous
+        // mapping, so the padding is there even when the file ends exactly on
+        // a page boundary. Past the end of the file within its last page the
+        // kernel reads zeros as well.
+        size_t page_size = (size_t)sysconf(_SC_PAGESIZE);
+        size_t size = (count + BUFFER_PADDING + page_size - 1) & ~(page_size - 1);
+        void* data = mmap(nullptr, size, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (data != MAP_FAILED) {
+            int flags = MAP_PRIVATE | MAP_FIXED | (populate ? MAP_POPULATE : 0);
+            if (mmap(data, count, PROT_READ, flags, fd, 0) == MAP_FAILED) {
+                munmap(data, size);
+                data = MAP_FAILED;
+            }
+        }
+        if (data != MAP_FAILED) {
+            // NOTE: the parser walks the input strictly front to back, so let
+            // the kernel read ahead aggressively and drop pages behind us.
+            madvise(data, count, MADV_SEQUENTIAL);
+            madvise(data, count, MADV_WILLNEED);
+
+            region->base = (uint8_t*)data;
+            region->size = size;
+            res.data = region->base;
+            res.count = count;
+        } else {
+            fprintf(stderr, "ERROR: Unable to map %llu bytes.\n", count);
+        }
+    } else if (!region) {
+        fprintf(stderr, "ERROR: Too many mapped buffers.\n");
+    }
+
+    return res;
+}
+
+// Reserve/commit buffers: reserve_buffer takes address space only
+// (PROT_NONE, nothing charged), and commit_buffer_range makes ranges of it
+// usable as they are needed, so memory follows what is actually written
+// instead of a worst-case estimate. Committing is also where the first-touch
+// cost can be paid up front on purpose, with a populate policy, rather than
+// inside whatever loop happens to write the memory first.
+enum class eCommitPolicy {
+    Lazy,         // pages are faulted in on first write
+    Populate,     // pages are faulted in by the commit itself
+    Huge,         // like Lazy, asking for transparent huge pages
+    HugePopulate, // like Populate, asking for transparent huge pages
+    Count
+};
+
+const char* commit_policy_to_str(eCommitPolicy policy)
+{
+    switch (policy) {
+    case eCommitPolicy::Lazy:
+        return "lazy";
+    case eCommitPolicy::Populate:
+        return "populate";
+    case eCommitPolicy::Huge:
+        return "huge";
+    case eCommitPolicy::HugePopulate:
+        return "huge-populate";
+    default:
+        return "unknown";
+    }
+}
+
+bool is_populate_policy(eCommitPolicy policy)
+{
+    return (policy == eCommitPolicy::Populate) || (policy == eCommitPolicy::HugePopulate);
+}
+
+bool is_huge_policy(eCommitPolicy policy)
+{
+    return (policy == eCommitPolicy::Huge) || (policy == eCommitPolicy::HugePopulate);
+}
+
+constexpr uint64_t COMMIT_PAGE_SIZE = 4096;
+constexpr uint64_t COMMIT_HUGE_PAGE_SIZE = 2 * 1024 * 1024;
+
+// NOTE: updated atomically, as parser threads commit their own ranges.
+struct commit_stats {
+    uint64_t reserved_bytes;
+    uint64_t committed_bytes;
+    uint64_t peak_committed_bytes;
+    uint64_t commit_count;
+    uint64_t commit_page_faults;
+};
+static commit_stats global_commit_stats;
+
+buffer reserve_buffer(size_t count, eCommitPolicy policy)
+{
+    buffer res = {};
+    mapped_region* region = find_mapped_region(nullptr);
+    if (region && count) {
+        void* data = mmap(nullptr, count, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        uint64_t page_count = (count + COMMIT_PAGE_SIZE - 1) / COMMIT_PAGE_SIZE;
+        uint64_t* commit_bits = (uint64_t*)calloc((page_count + 63) / 64, sizeof(uint64_t));
+        if ((data != MAP_FAILED) && commit_bits) {
+            if (is_huge_policy(policy)) {
+                madvise(data, count, MADV_HUGEPAGE);
+            }
+            region->base = (uint8_t*)data;
+            region->size = count;
+            region->commit_bits = commit_bits;
+            res.data = region->base;
+            res.count = count;
+            __atomic_fetch_add(&global_commit_stats.reserved_bytes, count, __ATOMIC_RELAXED);
+        } else {
+            fprintf(stderr, "ERROR: Unable to reserve %llu bytes.\n", count);
+            if (data != MAP_FAILED) {
+                munmap(data, count);
+            }
+            free(commit_bits);
+        }
+    } else if (!region) {
+        fprintf(stderr, "ERROR: Too many mapped buffers.\n");
+    }
+
+    return res;
+}
+
+// NOTE: flips the commit bits of the pages in [begin, end) to `committed` and
+// returns how many of them actually changed.
+uint64_t mark_committed_pages(mapped_region* region, uint64_t begin, uint64_t end, bool committed)
+{
+    uint64_t result = 0;
+    for (uint64_t page = begin / COMMIT_PAGE_SIZE; page < end / COMMIT_PAGE_SIZE; ++page) {
+        uint64_t bit = 1ull << (page % 64);
+        uint64_t* word = region->commit_bits + page / 64;
+        uint64_t old = committed ? __atomic_fetch_or(word, bit, __ATOMIC_RELAXED) : __atomic_fetch_and(word, ~bit, __ATOMIC_RELAXED);
+        result += ((old & bit) != 0) != committed;
+    }
+    return result;
+}
+
+// NOTE: whether `memory` came from reserve_buffer; anything else is usable in
+// full and has nothing to commit or decommit.
+bool is_reserved_buffer(buffer memory)
+{
+    mapped_region* region = memory.data ? find_mapped_region(memory.data) : nullptr;
+    return region && region->commit_bits;
+}
+
+#ifndef MADV_POPULATE_WRITE
+#define MADV_POPULATE_WRITE 23
+#endif
+
+// Makes [offset, offset + count) of a reserved buffer usable, widened to
+// whole pages. Committing pages that are already committed is harmless: their
+// contents are left as they are, even while other threads write to them.
+bool commit_buffer_range(buffer memory, size_t offset, size_t count, eCommitPolicy policy)
+{
+    mapped_region* region = find_mapped_region(memory.data);
+    uint64_t begin = offset & ~(COMMIT_PAGE_SIZE - 1);
+    uint64_t end = (offset + count + COMMIT_PAGE_SIZE - 1) & ~(COMMIT_PAGE_SIZE - 1);
+    if (end > memory.count) {
+        end = memory.count;
+    }
+    if (begin >= end) {
+        return true;
+    }
+    if (!region || !region->commit_bits) {
+        return false;
+    }
+
+    uint8_t* data = memory.data + begin;
+    uint64_t size = end - begin;
+    bool result = (mprotect(data, size, PROT_READ | PROT_WRITE) == 0);
+    if (result && is_populate_policy(policy)) {
+        uint64_t faults = lsp::read_thread_page_fault_count();
+        // NOTE: kernels before 5.14 have no MADV_POPULATE_WRITE; touch instead.
+        // The range can overlap pages that already hold data, possibly being
+        // written by another thread, so each touch is an atomic or with zero:
+        // a write fault that never changes the byte.
+        if (madvise(data, size, MADV_POPULATE_WRITE) != 0) {
+            for (uint64_t at = 0; at < size; at += COMMIT_PAGE_SIZE) {
+                __atomic_fetch_or(data + at, (uint8_t)0, __ATOMIC_RELAXED);
+            }
+        }
+        __atomic_fetch_add(&global_commit_stats.commit_page_faults, lsp::read_thread_page_fault_count() - faults, __ATOMIC_RELAXED);
+    }
+    if (result) {
+        uint64_t added = mark_committed_pages(region, begin, end, true) * COMMIT_PAGE_SIZE;
+        uint64_t committed = __atomic_add_fetch(&global_commit_stats.committed_bytes, added, __ATOMIC_RELAXED);
+        uint64_t peak = __atomic_load_n(&global_commit_stats.peak_committed_bytes, __ATOMIC_RELAXED);
+        while ((committed > peak) && !__atomic_compare_exchange_n(&global_commit_stats.peak_committed_bytes, &peak, committed, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+        }
+        __atomic_fetch_add(&global_commit_stats.commit_count, 1, __ATOMIC_RELAXED);
+    } else {
+        fprintf(stderr, "ERROR: Unable to commit %llu bytes.\n", size);
+    }
+    return result;
+}
+
+// Gives [offset, offset + count) of a reserved buffer back to the OS, shrunk
+// to whole pages; committing it again later gets fresh zero pages.
+void decommit_buffer_range(buffer memory, size_t offset, size_t count)
+{
+    mapped_region* region = find_mapped_region(memory.data);
+    uint64_t begin = (offset + COMMIT_PAGE_SIZE - 1) & ~(COMMIT_PAGE_SIZE - 1);
+    uint64_t end = (offset + count) & ~(COMMIT_PAGE_SIZE - 1);
+    if (end > memory.count) {
+        end = memory.count & ~(COMMIT_PAGE_SIZE - 1);
+    }
+    if (region && region->commit_bits && (begin < end)) {
+        madvise(memory.data + begin, end - begin, MADV_DONTNEED);
+        mprotect(memory.data + begin, end - begin, PROT_NONE);
+        uint64_t removed = mark_committed_pages(region, begin, end, false) * COMMIT_PAGE_SIZE;
+        __atomic_fetch_sub(&global_commit_stats.committed_bytes, removed, __ATOMIC_RELAXED);
+    }
+}
+
+void free_buffer(buffer* buffer)
+{
+    if (buffer->data) {
+        mapped_region* region = find_mapped_region(buffer->data);
+        if (region) {
+            if (region->commit_bits) {
+                uint64_t removed = mark_committed_pages(region, 0, region->size, false) * COMMIT_PAGE_SIZE;
+                __atomic_fetch_sub(&global_commit_stats.committed_bytes, removed, __ATOMIC_RELAXED);
+                __atomic_fetch_sub(&global_commit_stats.reserved_bytes, region->size, __ATOMIC_RELAXED);
+                free(region->commit_bits);
+            }
+            munmap(region->base, region->size);
+            *region = {};
+        } else {
+            free(buffer->data);
+        }
+    }
+    *buffer = {};
+}
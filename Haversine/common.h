@@ -1,4 +1,231 @@
 #pragma once
+#include "buffer.h"
+#include <cstdint>
+#include <cstring>
+
 struct haversine_pair {
     double x0, x1, y0, y1;
 };
+
+// NOTE: the SIMD kernels consume eight pairs per iteration at most, so the
+// columns are padded to a multiple of this with zero pairs, whose distance is
+// exactly zero, and never need a scalar tail loop.
+constexpr uint64_t HAVERSINE_LANE_PADDING = 8;
+constexpr uint64_t HAVERSINE_COLUMN_ALIGNMENT = 64;
+
+// NOTE: a lower bound on the bytes one pair takes in the input JSON (four
+// `"x0":0` fields of six bytes), which bounds how many pairs N bytes can hold.
+constexpr uint64_t HAVERSINE_MIN_JSON_PAIR_BYTES = 6 * 4;
+
+// NOTE: appending in order, a reserved SoA commits its columns in steps that
+// double from 64KB up to a huge page per column, so small inputs stay small
+// and large ones grow in huge-page-aligned steps. Each parser thread's region
+// sticks to the smallest step, since it only needs room for the pairs its
+// slice turns out to hold.
+constexpr uint64_t HAVERSINE_MIN_COMMIT_STEP_PAIRS = 64 * 1024 / sizeof(double);
+constexpr uint64_t HAVERSINE_MAX_COMMIT_STEP_PAIRS = COMMIT_HUGE_PAGE_SIZE / sizeof(double);
+
+// Structure-of-arrays pair storage: each coordinate lives in its own
+// 64-byte aligned column so a kernel can load N pairs with N-wide loads.
+// Columns from reserve_pairs_soa are only address space up to `committed`
+// pairs and grow as pairs are pushed; every other SoA is committed in full.
+struct haversine_pairs_soa {
+    uint64_t count;
+    uint64_t capacity;
+    uint64_t committed;
+    eCommitPolicy commit_policy;
+    double* x0;
+    double* y0;
+    double* x1;
+    double* y1;
+    buffer memory;
+};
+
+// A window of an SoA array that one parser thread fills on its own, starting
+// at pairs[first]. The windows are compacted into one run afterwards.
+struct haversine_pairs_region {
+    haversine_pairs_soa* pairs;
+    uint64_t first;
+    uint64_t max_count;
+    uint64_t count;
+    uint64_t committed;
+    bool is_overflowed; // NOTE: a pair was dropped for lack of room
+};
+
+// Fixed-size array output used by the AoS parsing entry points.
+struct haversine_pair_array {
+    haversine_pair* pairs;
+    uint64_t max_count;
+    uint64_t count;
+};
+
+uint64_t pad_pair_count(uint64_t count)
+{
+    return (count + HAVERSINE_LANE_PADDING - 1) & ~(HAVERSINE_LANE_PADDING - 1);
+}
+
+haversine_pairs_soa allocate_pairs_soa(uint64_t max_pair_count)
+{
+    haversine_pairs_soa result = {};
+    uint64_t capacity = pad_pair_count(max_pair_count);
+    uint64_t column_size = capacity * sizeof(double);
+    result.memory = allocate_buffer(4 * column_size + HAVERSINE_COLUMN_ALIGNMENT);
+    if (result.memory.data) {
+        uintptr_t base = ((uintptr_t)result.memory.data + HAVERSINE_COLUMN_ALIGNMENT - 1) & ~(HAVERSINE_COLUMN_ALIGNMENT - 1);
+        result.capacity = capacity;
+        result.committed = capacity;
+        result.x0 = (double*)(base + 0 * column_size);
+        result.y0 = (double*)(base + 1 * column_size);
+        result.x1 = (double*)(base + 2 * column_size);
+        result.y1 = (double*)(base + 3 * column_size);
+    }
+    return result;
+}
+
+// NOTE: the columns start on huge page boundaries, so a huge page policy can
+// back them with huge pages as they fill.
+haversine_pairs_soa reserve_pairs_soa(uint64_t max_pair_count, eCommitPolicy policy)
+{
+    haversine_pairs_soa result = {};
+    uint64_t capacity = pad_pair_count(max_pair_count);
+    uint64_t column_size = (capacity * sizeof(double) + COMMIT_HUGE_PAGE_SIZE - 1) & ~(COMMIT_HUGE_PAGE_SIZE - 1);
+    result.memory = reserve_buffer(4 * column_size + COMMIT_HUGE_PAGE_SIZE, policy);
+    if (result.memory.data) {
+        uintptr_t base = ((uintptr_t)result.memory.data + COMMIT_HUGE_PAGE_SIZE - 1) & ~(COMMIT_HUGE_PAGE_SIZE - 1);
+        result.capacity = capacity;
+        result.commit_policy = policy;
+        result.x0 = (double*)(base + 0 * column_size);
+        result.y0 = (double*)(base + 1 * column_size);
+        result.x1 = (double*)(base + 2 * column_size);
+        result.y1 = (double*)(base + 3 * column_size);
+    }
+    return result;
+}
+
+// NOTE: safe to call from several threads on disjoint (or even overlapping)
+// ranges; it does not touch pairs->committed. An SoA that is not reserved is
+// committed in full, so there is nothing to do for it.
+bool commit_pairs_range(haversine_pairs_soa* pairs, uint64_t first, uint64_t count)
+{
+    bool result = true;
+    if ((first + count > pairs->committed) && is_reserved_buffer(pairs->memory)) {
+        double* columns[4] = { pairs->x0, pairs->y0, pairs->x1, pairs->y1 };
+        for (double* column : columns) {
+            uint64_t offset = (uint64_t)((uint8_t*)(column + first) - pairs->memory.data);
+            result = commit_buffer_range(pairs->memory, offset, count * sizeof(double), pairs->commit_policy) && result;
+        }
+    }
+    return result;
+}
+
+// Commits the columns up to at least `count` pairs.
+bool grow_pairs_soa(haversine_pairs_soa* pairs, uint64_t count)
+{
+    uint64_t committed = pairs->committed;
+    while (committed < count) {
+        uint64_t step = committed;
+        step = (step < HAVERSINE_MIN_COMMIT_STEP_PAIRS) ? HAVERSINE_MIN_COMMIT_STEP_PAIRS : step;
+        step = (step > HAVERSINE_MAX_COMMIT_STEP_PAIRS) ? HAVERSINE_MAX_COMMIT_STEP_PAIRS : step;
+        committed += step;
+    }
+    if (committed > pairs->capacity) {
+        committed = pairs->capacity;
+    }
+    if ((committed > pairs->committed) && commit_pairs_range(pairs, pairs->committed, committed - pairs->committed)) {
+        pairs->committed = committed;
+    }
+    return count <= pairs->committed;
+}
+
+// NOTE: only whole pages inside the range are given back, so pairs sharing
+// a page with it are safe. No-op for an SoA that is not reserved.
+void decommit_pairs_range(haversine_pairs_soa* pairs, uint64_t first, uint64_t count)
+{
+    double* columns[4] = { pairs->x0, pairs->y0, pairs->x1, pairs->y1 };
+    for (double* column : columns) {
+        uint64_t offset = (uint64_t)((uint8_t*)(column + first) - pairs->memory.data);
+        decommit_buffer_range(pairs->memory, offset, count * sizeof(double));
+    }
+}
+
+// Gives back everything past the padded count, e.g. what parser threads
+// committed for pairs that were then compacted away. An SoA that is not
+// reserved keeps all of its columns committed.
+void trim_pairs_soa(haversine_pairs_soa* pairs)
+{
+    uint64_t keep = pad_pair_count(pairs->count);
+    if ((keep < pairs->capacity) && is_reserved_buffer(pairs->memory)) {
+        decommit_pairs_range(pairs, keep, pairs->capacity - keep);
+        if (pairs->committed > keep) {
+            pairs->committed = keep;
+        }
+    }
+}
+
+void free_pairs_soa(haversine_pairs_soa* pairs)
+{
+    free_buffer(&pairs->memory);
+    *pairs = {};
+}
+
+void push_pair(haversine_pair_array* output, haversine_pair const& pair)
+{
+    if (output->count < output->max_count) {
+        output->pairs[output->count++] = pair;
+    }
+}
+
+void push_pair(haversine_pairs_soa* output, haversine_pair const& pair)
+{
+    // NOTE: the padding lanes stay reserved for pad_pairs_soa.
+    uint64_t padded = pad_pair_count(output->count + 1);
+    if ((padded <= output->committed) || ((padded <= output->capacity) && grow_pairs_soa(output, padded))) {
+        uint64_t i = output->count++;
+        output->x0[i] = pair.x0;
+        output->y0[i] = pair.y0;
+        output->x1[i] = pair.x1;
+        output->y1[i] = pair.y1;
+    }
+}
+
+// NOTE: a region of a reserved SoA commits its own range as it fills, so the
+// parser threads never wait on each other for it.
+void commit_pairs_region(haversine_pairs_region* output)
+{
+    uint64_t committed = output->count + HAVERSINE_MIN_COMMIT_STEP_PAIRS;
+    if (committed > output->max_count) {
+        committed = output->max_count;
+    }
+    if (commit_pairs_range(output->pairs, output->first + output->committed, committed - output->committed)) {
+        output->committed = committed;
+    } else {
+        output->max_count = output->committed;
+    }
+}
+
+void push_pair(haversine_pairs_region* output, haversine_pair const& pair)
+{
+    if ((output->count == output->committed) && (output->count < output->max_count)) {
+        commit_pairs_region(output);
+    }
+    if (output->count < output->max_count) {
+        uint64_t i = output->first + output->count++;
+        output->pairs->x0[i] = pair.x0;
+        output->pairs->y0[i] = pair.y0;
+        output->pairs->x1[i] = pair.x1;
+        output->pairs->y1[i] = pair.y1;
+    } else {
+        output->is_overflowed = true;
+    }
+}
+
+// Zero-fills the columns from `count` up to the next lane multiple.
+void pad_pairs_soa(haversine_pairs_soa* pairs)
+{
+    uint64_t padded = pad_pair_count(pairs->count);
+    uint64_t pad_bytes = (padded - pairs->count) * sizeof(double);
+    memset(pairs->x0 + pairs->count, 0, pad_bytes);
+    memset(pairs->y0 + pairs->count, 0, pad_bytes);
+    memset(pairs->x1 + pairs->count, 0, pad_bytes);
+    memset(pairs->y1 + pairs->count, 0, pad_bytes);
+}
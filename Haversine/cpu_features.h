@@ -0,0 +1,125 @@
+#pragma once
+#include <cpuid.h>
+#include <cstdint>
+#include <cstring>
+
+namespace lsp {
+
+// The binary is built for baseline x86-64, with no arch flags, and every
+// faster kernel is compiled on its own with a target attribute. Which of them
+// run is decided once at startup from cpuid: each module has a select_*
+// function that takes an ISA level and returns its best kernel for it, and
+// the function pointers they fill are bound to the best level by default.
+// bind_isa_kernels (main.cpp) rebinds them all to a lower level on request,
+// so the same binary can benchmark every path on one host.
+enum class eIsaLevel {
+    Scalar,
+    Sse42,
+    Avx2,   // with FMA
+    Avx512, // F and BW
+    Count
+};
+
+struct cpu_features {
+    bool sse42;
+    bool avx2;
+    bool fma;
+    bool avx512f;
+    bool avx512bw;
+};
+
+// NOTE: the XSAVE state the OS enables, from XCR0. A CPU can support AVX while
+// the OS does not save the wider registers, and then using them faults.
+uint64_t read_xcr0()
+{
+    uint32_t low = 0;
+    uint32_t high = 0;
+    __asm__ volatile("xgetbv" : "=a"(low), "=d"(high) : "c"(0));
+    return ((uint64_t)high << 32) | low;
+}
+
+cpu_features detect_cpu_features()
+{
+    cpu_features result = {};
+    uint32_t eax = 0;
+    uint32_t ebx = 0;
+    uint32_t ecx = 0;
+    uint32_t edx = 0;
+    uint32_t max_leaf = __get_cpuid_max(0, nullptr);
+    if (max_leaf >= 1) {
+        __cpuid(1, eax, ebx, ecx, edx);
+        result.sse42 = (ecx & bit_SSE4_2) != 0;
+
+        bool has_os_avx = false;
+        bool has_os_avx512 = false;
+        if ((ecx & bit_OSXSAVE) && (ecx & bit_AVX)) {
+            uint64_t xcr0 = read_xcr0();
+            // NOTE: SSE and AVX state; then opmask and both halves of ZMM.
+            has_os_avx = (xcr0 & 0x06) == 0x06;
+            has_os_avx512 = has_os_avx && ((xcr0 & 0xE0) == 0xE0);
+        }
+        result.fma = has_os_avx && (ecx & bit_FMA);
+
+        if (max_leaf >= 7) {
+            __cpuid_count(7, 0, eax, ebx, ecx, edx);
+            result.avx2 = has_os_avx && (ebx & bit_AVX2);
+            result.avx512f = has_os_avx512 && (ebx & bit_AVX512F);
+            result.avx512bw = has_os_avx512 && (ebx & bit_AVX512BW);
+        }
+    }
+    return result;
+}
+
+cpu_features const& get_cpu_features()
+{
+    static cpu_features const result = detect_cpu_features();
+    return result;
+}
+
+eIsaLevel get_best_isa_level()
+{
+    cpu_features const& features = get_cpu_features();
+    eIsaLevel result = eIsaLevel::Scalar;
+    if (features.avx512f && features.avx512bw && features.avx2 && features.fma) {
+        result = eIsaLevel::Avx512;
+    } else if (features.avx2 && features.fma) {
+        result = eIsaLevel::Avx2;
+    } else if (features.sse42) {
+        result = eIsaLevel::Sse42;
+    }
+    return result;
+}
+
+bool is_isa_level_supported(eIsaLevel level)
+{
+    return level <= get_best_isa_level();
+}
+
+const char* isa_level_to_str(eIsaLevel level)
+{
+    switch (level) {
+    case eIsaLevel::Scalar:
+        return "scalar";
+    case eIsaLevel::Sse42:
+        return "sse4.2";
+    case eIsaLevel::Avx2:
+        return "avx2";
+    case eIsaLevel::Avx512:
+        return "avx512";
+    default:
+        return "unknown";
+    }
+}
+
+bool parse_isa_level(const char* name, eIsaLevel* level)
+{
+    for (uint32_t i = 0; i < (uint32_t)eIsaLevel::Count; ++i) {
+        if (strcmp(name, isa_level_to_str((eIsaLevel)i)) == 0) {
+            *level = (eIsaLevel)i;
+            return true;
+        }
+    }
+    return false;
+}
+
+} // namespace lsp
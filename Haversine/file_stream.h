@@ -0,0 +1,507 @@
+#pragma once
+#include "buffer.h"
+#include <cerrno>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <linux/io_uring.h>
+#include <mutex>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <thread>
+#include <unistd.h>
+
+namespace lsp {
+
+// Reads a file front to back in fixed-size chunks into a small ring of
+// buffers, ahead of the consumer, so the reads overlap with whatever is done
+// with the chunks already read. The consumer takes chunks strictly in order
+// with wait_for_chunk and hands each one back with release_chunk, which frees
+// its slot for the next read. Reads are issued either by a background thread
+// doing pread, or through io_uring with a read in flight per free slot and no
+// extra thread at all. With `direct` the file is opened O_DIRECT so the reads
+// bypass the page cache.
+//
+// NOTE: every slot has STREAM_CARRY_SIZE bytes of room in front of its data,
+// so a consumer can move the unfinished end of the previous chunk right in
+// front of the next one and keep working on contiguous memory. Behind its
+// data it has a page of room for the zero byte wait_for_chunk puts right
+// after each chunk, so a chunk ends like a padded buffer (see allocate_buffer).
+//
+// A pipe, or "-" for stdin, is streamed too, with plain reads on the reader
+// thread: its size is not known up front, so the chunk count stays open until
+// the writer closes its end, and there is no limit on how much goes through.
+enum class eStreamBackend {
+    Thread,
+    Uring,
+    Count
+};
+
+constexpr uint64_t STREAM_CHUNK_SIZE = 1024 * 1024;
+constexpr uint64_t STREAM_CARRY_SIZE = 64 * 1024;
+constexpr uint64_t STREAM_DIRECT_ALIGNMENT = 4096;
+constexpr uint64_t STREAM_PADDING_SIZE = 4096;
+constexpr uint32_t STREAM_SLOT_COUNT = 3;
+constexpr uint64_t STREAM_UNKNOWN_CHUNK_COUNT = ~0ull;
+
+struct stream_options {
+    eStreamBackend backend;
+    bool direct;
+};
+
+struct stream_chunk {
+    uint8_t* data;
+    uint64_t count;
+    uint32_t slot_index;
+    bool is_last;
+};
+
+struct stream_slot {
+    uint8_t* data;
+    uint64_t count;
+    bool is_filled;
+    bool is_in_use;
+};
+
+struct uring_queue {
+    int fd;
+    uint32_t reads_in_flight;
+    void* sq_ring;
+    size_t sq_ring_size;
+    void* cq_ring;
+    size_t cq_ring_size;
+    io_uring_sqe* sqes;
+    size_t sqes_size;
+    uint32_t* sq_tail;
+    uint32_t* sq_mask;
+    uint32_t* sq_array;
+    uint32_t* cq_head;
+    uint32_t* cq_tail;
+    uint32_t* cq_mask;
+    io_uring_cqe* cqes;
+};
+
+struct file_stream {
+    int fd;
+    // NOTE: for a pipe, the bytes read so far.
+    uint64_t file_size;
+    uint64_t chunk_count;
+    bool is_pipe;
+    stream_options options;
+    buffer memory;
+    stream_slot slots[STREAM_SLOT_COUNT];
+    uint64_t next_chunk_to_read;
+    uint64_t next_chunk_to_consume;
+    bool had_error;
+
+    std::thread reader;
+    std::mutex mutex;
+    std::condition_variable changed;
+    bool is_stopping;
+
+    uring_queue uring;
+};
+
+const char* stream_backend_to_str(eStreamBackend backend)
+{
+    switch (backend) {
+    case eStreamBackend::Thread:
+        return "thread";
+    case eStreamBackend::Uring:
+        return "uring";
+    default:
+        return "unknown";
+    }
+}
+
+bool parse_stream_backend(const char* name, eStreamBackend* backend)
+{
+    for (uint32_t i = 0; i < (uint32_t)eStreamBackend::Count; ++i) {
+        if (strcmp(name, stream_backend_to_str((eStreamBackend)i)) == 0) {
+            *backend = (eStreamBackend)i;
+            return true;
+        }
+    }
+    return false;
+}
+
+// True for stdin ("-"), pipes and anything else that can only be read once,
+// front to back, and has no size to ask for.
+bool is_sequential_input(const char* filename)
+{
+    struct stat s = {};
+    return (strcmp(filename, "-") == 0) || ((stat(filename, &s) == 0) && !S_ISREG(s.st_mode));
+}
+
+stream_slot* get_chunk_slot(file_stream* stream, uint64_t chunk_index)
+{
+    return stream->slots + (chunk_index % STREAM_SLOT_COUNT);
+}
+
+uint64_t get_chunk_size(file_stream* stream, uint64_t chunk_index)
+{
+    uint64_t remaining = stream->file_size - chunk_index * STREAM_CHUNK_SIZE;
+    return (remaining < STREAM_CHUNK_SIZE) ? remaining : STREAM_CHUNK_SIZE;
+}
+
+// NOTE: O_DIRECT wants the length to be a multiple of the block size too, so
+// the last chunk asks for whole blocks and gets back a short read.
+uint64_t get_read_size(file_stream* stream, uint64_t chunk_index)
+{
+    uint64_t result = get_chunk_size(stream, chunk_index);
+    if (stream->options.direct) {
+        result = (result + STREAM_DIRECT_ALIGNMENT - 1) & ~(STREAM_DIRECT_ALIGNMENT - 1);
+    }
+    return result;
+}
+
+bool read_chunk(file_stream* stream, stream_slot* slot, uint64_t chunk_index)
+{
+    uint64_t offset = chunk_index * STREAM_CHUNK_SIZE;
+    uint64_t expected = get_chunk_size(stream, chunk_index);
+    uint64_t wanted = get_read_size(stream, chunk_index);
+    uint64_t count = 0;
+    while (count < expected) {
+        ssize_t result = pread(stream->fd, slot->data + count, wanted - count, offset + count);
+        if (result <= 0) {
+            break;
+        }
+        count += result;
+    }
+    slot->count = (count < expected) ? count : expected;
+    return count >= expected;
+}
+
+// NOTE: fills the chunk completely unless the writer closes the pipe first;
+// a short chunk is therefore the last one.
+bool read_pipe_chunk(file_stream* stream, stream_slot* slot)
+{
+    uint64_t count = 0;
+    ssize_t result = 1;
+    while ((count < STREAM_CHUNK_SIZE) && (result > 0)) {
+        result = read(stream->fd, slot->data + count, STREAM_CHUNK_SIZE - count);
+        if ((result < 0) && (errno == EINTR)) {
+            result = 1;
+        } else if (result > 0) {
+            count += result;
+        }
+    }
+    slot->count = count;
+    return result >= 0;
+}
+
+void run_stream_reader(file_stream* stream)
+{
+    for (uint64_t chunk_index = 0; chunk_index < stream->chunk_count; ++chunk_index) {
+        stream_slot* slot = get_chunk_slot(stream, chunk_index);
+        {
+            std::unique_lock<std::mutex> lock(stream->mutex);
+            stream->changed.wait(lock, [&] { return stream->is_stopping || (!slot->is_filled && !slot->is_in_use); });
+            if (stream->is_stopping) {
+                break;
+            }
+        }
+
+        bool is_read = stream->is_pipe ? read_pipe_chunk(stream, slot) : read_chunk(stream, slot, chunk_index);
+
+        std::lock_guard<std::mutex> lock(stream->mutex);
+        if (stream->is_pipe) {
+            stream->file_size += slot->count;
+            if (!is_read || (slot->count < STREAM_CHUNK_SIZE)) {
+                stream->chunk_count = chunk_index + 1;
+            }
+        }
+        slot->is_filled = true;
+        stream->had_error |= !is_read;
+        stream->changed.notify_all();
+    }
+}
+
+bool start_uring(uring_queue* uring, uint32_t entry_count)
+{
+    *uring = {};
+    uring->fd = -1;
+    io_uring_params params = {};
+    int fd = (int)syscall(__NR_io_uring_setup, entry_count, &params);
+    if (fd < 0) {
+        return false;
+    }
+
+    uring->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(uint32_t);
+    uring->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+    // NOTE: newer kernels map both rings with a single mmap.
+    bool is_single_map = params.features & IORING_FEAT_SINGLE_MMAP;
+    if (is_single_map) {
+        if (uring->cq_ring_size > uring->sq_ring_size) {
+            uring->sq_ring_size = uring->cq_ring_size;
+        }
+        uring->cq_ring_size = uring->sq_ring_size;
+    }
+    int prot = PROT_READ | PROT_WRITE;
+    int flags = MAP_SHARED | MAP_POPULATE;
+    void* sq_ring = mmap(0, uring->sq_ring_size, prot, flags, fd, IORING_OFF_SQ_RING);
+    void* cq_ring = is_single_map ? sq_ring : mmap(0, uring->cq_ring_size, prot, flags, fd, IORING_OFF_CQ_RING);
+    uring->sqes_size = params.sq_entries * sizeof(io_uring_sqe);
+    void* sqes = mmap(0, uring->sqes_size, prot, flags, fd, IORING_OFF_SQES);
+    uring->fd = fd;
+    uring->sq_ring = (sq_ring != MAP_FAILED) ? sq_ring : nullptr;
+    uring->cq_ring = (cq_ring != MAP_FAILED) ? cq_ring : nullptr;
+    uring->sqes = (sqes != MAP_FAILED) ? (io_uring_sqe*)sqes : nullptr;
+    if (!uring->sq_ring || !uring->cq_ring || !uring->sqes) {
+        return false;
+    }
+
+    uint8_t* sq = (uint8_t*)uring->sq_ring;
+    uint8_t* cq = (uint8_t*)uring->cq_ring;
+    uring->sq_tail = (uint32_t*)(sq + params.sq_off.tail);
+    uring->sq_mask = (uint32_t*)(sq + params.sq_off.ring_mask);
+    uring->sq_array = (uint32_t*)(sq + params.sq_off.array);
+    uring->cq_head = (uint32_t*)(cq + params.cq_off.head);
+    uring->cq_tail = (uint32_t*)(cq + params.cq_off.tail);
+    uring->cq_mask = (uint32_t*)(cq + params.cq_off.ring_mask);
+    uring->cqes = (io_uring_cqe*)(cq + params.cq_off.cqes);
+    return true;
+}
+
+void stop_uring(uring_queue* uring)
+{
+    if (uring->sqes) {
+        munmap(uring->sqes, uring->sqes_size);
+    }
+    if (uring->cq_ring && (uring->cq_ring != uring->sq_ring)) {
+        munmap(uring->cq_ring, uring->cq_ring_size);
+    }
+    if (uring->sq_ring) {
+        munmap(uring->sq_ring, uring->sq_ring_size);
+    }
+    if (uring->fd >= 0) {
+        close(uring->fd);
+    }
+    *uring = {};
+    uring->fd = -1;
+}
+
+bool submit_uring_read(uring_queue* uring, int fd, uint8_t* data, uint64_t count, uint64_t offset, uint64_t user_data)
+{
+    uint32_t tail = *uring->sq_tail;
+    uint32_t index = tail & *uring->sq_mask;
+    io_uring_sqe* sqe = uring->sqes + index;
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = fd;
+    sqe->addr = (uint64_t)data;
+    sqe->len = (uint32_t)count;
+    sqe->off = offset;
+    sqe->user_data = user_data;
+    uring->sq_array[index] = index;
+    __atomic_store_n(uring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+    bool result = syscall(__NR_io_uring_enter, uring->fd, 1, 0, 0, 0, 0) == 1;
+    uring->reads_in_flight += result;
+    return result;
+}
+
+bool submit_chunk_read(file_stream* stream, uint64_t chunk_index)
+{
+    stream_slot* slot = get_chunk_slot(stream, chunk_index);
+    slot->count = 0;
+    return submit_uring_read(&stream->uring, stream->fd, slot->data, get_read_size(stream, chunk_index),
+        chunk_index * STREAM_CHUNK_SIZE, chunk_index);
+}
+
+// Blocks until at least one read completes and marks the slots that are done.
+void reap_uring_reads(file_stream* stream)
+{
+    uring_queue* uring = &stream->uring;
+    syscall(__NR_io_uring_enter, uring->fd, 0, 1, IORING_ENTER_GETEVENTS, 0, 0);
+    uint32_t head = *uring->cq_head;
+    uint32_t tail = __atomic_load_n(uring->cq_tail, __ATOMIC_ACQUIRE);
+    for (; head != tail; ++head) {
+        io_uring_cqe* cqe = uring->cqes + (head & *uring->cq_mask);
+        --uring->reads_in_flight;
+        uint64_t chunk_index = cqe->user_data;
+        stream_slot* slot = get_chunk_slot(stream, chunk_index);
+        uint64_t expected = get_chunk_size(stream, chunk_index);
+        bool is_read = (cqe->res > 0);
+        if (is_read) {
+            slot->count += cqe->res;
+            if (slot->count < expected) {
+                // NOTE: a short read before the end of the file; ask for the rest.
+                uint64_t wanted = get_read_size(stream, chunk_index) - slot->count;
+                uint64_t offset = chunk_index * STREAM_CHUNK_SIZE + slot->count;
+                is_read = submit_uring_read(uring, stream->fd, slot->data + slot->count, wanted, offset, chunk_index);
+                if (is_read) {
+                    continue;
+                }
+            } else {
+                slot->count = expected;
+            }
+        }
+        slot->is_filled = true;
+        stream->had_error |= !is_read;
+    }
+    __atomic_store_n(uring->cq_head, head, __ATOMIC_RELEASE);
+}
+
+bool open_file_stream(file_stream* stream, const char* filename, stream_options options)
+{
+    stream->fd = -1;
+    stream->uring.fd = -1;
+    stream->options = options;
+
+    stream->is_pipe = is_sequential_input(filename);
+    if (stream->is_pipe) {
+        stream->options.direct = false;
+        stream->options.backend = eStreamBackend::Thread;
+    }
+    if (strcmp(filename, "-") == 0) {
+        stream->fd = dup(STDIN_FILENO);
+    } else {
+        stream->fd = open(filename, O_RDONLY | (stream->options.direct ? O_DIRECT : 0));
+    }
+    if ((stream->fd < 0) && stream->options.direct) {
+        fprintf(stderr, "WARNING: O_DIRECT is not supported for `%s`, reading through the page cache.\n", filename);
+        stream->options.direct = false;
+        stream->fd = open(filename, O_RDONLY);
+    }
+    if (stream->fd < 0) {
+        fprintf(stderr, "Error: unable to open `%s`.\n", filename);
+        return false;
+    }
+
+    if (stream->is_pipe) {
+        stream->file_size = 0;
+        stream->chunk_count = STREAM_UNKNOWN_CHUNK_COUNT;
+    } else {
+        struct stat s = {};
+        fstat(stream->fd, &s);
+        stream->file_size = s.st_size;
+        // NOTE: an empty file is still handed out as one empty, last chunk.
+        stream->chunk_count = (stream->file_size + STREAM_CHUNK_SIZE - 1) / STREAM_CHUNK_SIZE;
+        if (!stream->chunk_count) {
+            stream->chunk_count = 1;
+        }
+    }
+
+    // NOTE: mmap rather than malloc so every slot is page aligned for O_DIRECT.
+    uint64_t slot_size = STREAM_CARRY_SIZE + STREAM_CHUNK_SIZE + STREAM_PADDING_SIZE;
+    void* memory = mmap(0, STREAM_SLOT_COUNT * slot_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (memory == MAP_FAILED) {
+        fprintf(stderr, "ERROR: Unable to allocate %llu bytes.\n", STREAM_SLOT_COUNT * slot_size);
+        close(stream->fd);
+        stream->fd = -1;
+        return false;
+    }
+    stream->memory.data = (uint8_t*)memory;
+    stream->memory.count = STREAM_SLOT_COUNT * slot_size;
+    for (uint32_t i = 0; i < STREAM_SLOT_COUNT; ++i) {
+        stream->slots[i] = {};
+        stream->slots[i].data = stream->memory.data + i * slot_size + STREAM_CARRY_SIZE;
+    }
+
+    if (stream->options.backend == eStreamBackend::Uring) {
+        if (!start_uring(&stream->uring, STREAM_SLOT_COUNT)) {
+            fprintf(stderr, "WARNING: io_uring is not available, reading on a thread instead.\n");
+            stop_uring(&stream->uring);
+            stream->options.backend = eStreamBackend::Thread;
+        }
+    }
+
+    if (stream->options.backend == eStreamBackend::Uring) {
+        while ((stream->next_chunk_to_read < STREAM_SLOT_COUNT) && (stream->next_chunk_to_read < stream->chunk_count)) {
+            stream->had_error |= !submit_chunk_read(stream, stream->next_chunk_to_read++);
+        }
+    } else {
+        stream->reader = std::thread(run_stream_reader, stream);
+    }
+    return true;
+}
+
+// Hands out the next chunk of the file. Returns false past the last chunk or
+// if the file could not be read.
+bool wait_for_chunk(file_stream* stream, stream_chunk* chunk)
+{
+    uint64_t chunk_index = stream->next_chunk_to_consume;
+    stream_slot* slot = get_chunk_slot(stream, chunk_index);
+    bool result = false;
+    bool is_last = false;
+    if (stream->options.backend == eStreamBackend::Uring) {
+        result = (chunk_index < stream->chunk_count);
+        while (result && !slot->is_filled && !stream->had_error) {
+            reap_uring_reads(stream);
+        }
+        result = result && !stream->had_error;
+        is_last = (chunk_index + 1 == stream->chunk_count);
+        slot->is_filled = false;
+        slot->is_in_use = result;
+    } else {
+        // NOTE: the reader may only find out that a pipe has ended after the
+        // consumer is already waiting on the chunk past the end.
+        std::unique_lock<std::mutex> lock(stream->mutex);
+        stream->changed.wait(lock, [&] { return slot->is_filled || (chunk_index >= stream->chunk_count); });
+        result = (chunk_index < stream->chunk_count) && !stream->had_error;
+        is_last = (chunk_index + 1 == stream->chunk_count);
+        slot->is_filled = false;
+        slot->is_in_use = result;
+    }
+
+    if (result) {
+        ++stream->next_chunk_to_consume;
+        chunk->data = slot->data;
+        chunk->count = slot->count;
+        chunk->data[chunk->count] = 0;
+        chunk->slot_index = (uint32_t)(chunk_index % STREAM_SLOT_COUNT);
+        chunk->is_last = is_last;
+    } else if (stream->had_error) {
+        fprintf(stderr, "Error: unable to read the input.\n");
+    }
+    return result;
+}
+
+void release_chunk(file_stream* stream, stream_chunk const* chunk)
+{
+    stream_slot* slot = stream->slots + chunk->slot_index;
+    if (stream->options.backend == eStreamBackend::Uring) {
+        slot->is_in_use = false;
+        if (!stream->had_error && (stream->next_chunk_to_read < stream->chunk_count)) {
+            stream->had_error |= !submit_chunk_read(stream, stream->next_chunk_to_read++);
+        }
+    } else {
+        std::lock_guard<std::mutex> lock(stream->mutex);
+        slot->is_in_use = false;
+        stream->changed.notify_all();
+    }
+}
+
+void close_file_stream(file_stream* stream)
+{
+    if (stream->reader.joinable()) {
+        {
+            std::lock_guard<std::mutex> lock(stream->mutex);
+            stream->is_stopping = true;
+        }
+        stream->changed.notify_all();
+        stream->reader.join();
+    }
+    if (stream->uring.fd >= 0) {
+        // NOTE: reads still in flight write into the slots; wait them out
+        // before the memory goes away.
+        while (stream->uring.reads_in_flight) {
+            reap_uring_reads(stream);
+        }
+        stop_uring(&stream->uring);
+    }
+    if (stream->memory.data) {
+        munmap(stream->memory.data, stream->memory.count);
+        stream->memory = {};
+    }
+    if (stream->fd >= 0) {
+        close(stream->fd);
+        stream->fd = -1;
+    }
+}
+
+} // namespace lsp
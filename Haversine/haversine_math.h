@@ -0,0 +1,447 @@
+#pragma once
+#include "common.h"
+#include "cpu_features.h"
+#include "thread_pool.h"
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <immintrin.h>
+
+namespace lsp {
+
+    static double Square(double a) {
+        return a * a;
+    }
+
+    static double RadiansFromDegrees(double degrees) {
+        return 0.01745329251994329577 * degrees;
+    }
+
+static double ReferenceHaversine(double X0, double Y0, double X1, double Y1, double EarthRadius = 6372.8) {
+  double lat1 = Y0, lat2 = Y1, lon1 = X0, lon2 = X1;
+  double dLat = RadiansFromDegrees(lat2 - lat1);
+  double dLon = RadiansFromDegrees(lon2 - lon1);
+  lat1 = RadiansFromDegrees(lat1);
+  lat2 = RadiansFromDegrees(lat2);
+
+  double a = Square(sin(dLat / 2.0)) + cos(lat1) * cos(lat2) * Square(sin(dLon / 2.0));
+  double c = 2.0 * asin(sqrt(a));
+
+  double Result = EarthRadius * c;
+
+  return Result;
+}
+
+    constexpr double EARTH_RADIUS = 6372.8;
+    constexpr double PI64 = 3.14159265358979323846;
+    constexpr double HALF_PI64 = 1.57079632679489661923;
+    // NOTE: the rounding error of PI64 and HALF_PI64. pi - x is exact in
+    // doubles for x >= pi/2 (and pi/2 - x for x >= pi/4), so adding the low
+    // part back keeps full relative precision in the folded arguments near
+    // zero, i.e. for antipodal longitudes and for latitudes near the poles.
+    constexpr double PI64_LOW = 1.2246467991473532e-16;
+    constexpr double HALF_PI64_LOW = 6.123233995736766e-17;
+
+    // NOTE: the SIMD kernels do not call libm. Every input the haversine needs
+    // is reduced to one of two polynomials, fitted on Chebyshev nodes:
+    //   sin(x)  = x * S(x^2)          for x in [0, pi/2]
+    //   asin(x) = x * A(x^2)          for x in [0, 1/2]
+    //   asin(x) = pi/2 - 2 * asin(sqrt((1 - x) / 2))   for x in (1/2, 1]
+    // sin^2 of a half-angle in [-pi, pi] folds |x| to min(|x|, pi - |x|), and
+    // cos of a latitude in [-pi/2, pi/2] is sin(pi/2 - |x|).
+    //
+    // The number of terms of S and A is a compile-time knob (see
+    // HAVERSINE_SIN_TERMS and HAVERSINE_ASIN_TERMS); `Haversine --math-check`
+    // prints what each choice costs in accuracy and cycles. With the default,
+    // largest fits (~2e-17 relative) the error is dominated by the rounding of
+    // the arguments. Tolerance against ReferenceHaversine with the default
+    // fits, which `--math-check` asserts: a distance d agrees to
+    // 8 eps / max(|cos(d / 2R)|, sqrt(eps)) relative, eps = 2^-52. That is
+    // ~2e-15 for most pairs, but near antipodal pairs a = sin^2(d / 2R) tends
+    // to 1, where asin(sqrt(a)) magnifies the rounding of a (in libm's result
+    // as much as ours), up to ~3e-8 relative at the antipode itself (measured
+    // 3.4e-9 worst case over 4M random, nearby and near-antipodal pairs, i.e.
+    // < 0.1 mm). The average agrees to 1e-12 relative (measured 3e-13).
+    constexpr uint32_t HAVERSINE_SIN_MIN_TERMS = 4;
+    constexpr uint32_t HAVERSINE_SIN_MAX_TERMS = 9;
+    alignas(64) constexpr double haversine_sin_fits[HAVERSINE_SIN_MAX_TERMS - HAVERSINE_SIN_MIN_TERMS + 1][HAVERSINE_SIN_MAX_TERMS] = {
+        {0.9999992370615313, -0.16665676500413848, 0.008313191414376437, -0.00018522539324609908},
+        {0.999999995698809, -0.16666657947846011, 0.008333050170671773, -0.00019809017408678003, 2.605107635334788e-06},
+        {0.9999999999829191, -0.16666666616815567, 0.008333330974207583, -0.00019840861179319552, 2.752526981229885e-06,
+         -2.3889217773452806e-08},
+        {0.9999999999999496, -0.16666666666466673, 0.00833333332035835, -0.00019841266683130672, 2.7556952912858047e-06,
+         -2.503026818882279e-08, 1.54112197466489e-10},
+        {0.9999999999999999, -0.16666666666666072, 0.008333333333282756, -0.00019841269824861897, 2.7557316609073673e-06,
+         -2.505188194671259e-08, 1.6048168318165643e-10, -7.374387503862757e-13},
+        {1.0, -0.16666666666666666, 0.008333333333333186, -0.00019841269841208676, 2.7557319211229606e-06,
+         -2.505210689056952e-08, 1.605894087848656e-10, -7.643026557971632e-13, 2.7215749422983443e-15},
+    };
+
+    constexpr uint32_t HAVERSINE_ASIN_MIN_TERMS = 5;
+    constexpr uint32_t HAVERSINE_ASIN_MAX_TERMS = 13;
+    alignas(64) constexpr double haversine_asin_fits[HAVERSINE_ASIN_MAX_TERMS - HAVERSINE_ASIN_MIN_TERMS + 1][HAVERSINE_ASIN_MAX_TERMS] = {
+        {1.0000000726414175, 0.1666521958644291, 0.07545345579877545, 0.03979444325491703, 0.050357681931844235},
+        {0.999999995983738, 0.16666782005775338, 0.07494696687423973, 0.045520635631714566, 0.02399399965364759,
+         0.04241737375979984},
+        {1.0000000002307783, 0.16666657639575913, 0.07500571381024686, 0.04450870949865153, 0.03185718889411276,
+         0.014295256037820107, 0.0376771383418486},
+        {0.9999999999863537, 0.16666667364186447, 0.07499941908754719, 0.04466113930866896, 0.03010250689966149,
+         0.024650862660604088, 0.0074010072390753795, 0.0347484248080839},
+        {1.000000000000825, 0.16666666613278705, 0.07500005655821883, 0.04464056469220037, 0.03042811901907943,
+         0.02185574259984348, 0.02068132717169167, 0.0019156113431105127, 0.03295759470084881},
+        {0.9999999999999493, 0.16666666670723188, 0.07499999467531561, 0.044643126897073435, 0.030375046838709736,
+         0.022472629272259407, 0.016472738109361944, 0.018638508213446328, -0.0028563505336838967, 0.03194399638410843},
+        {1.000000000000003, 0.1666666666636023, 0.07500000048801558, 0.04464282695575735, 0.03038289742013321,
+         0.02235471795166217, 0.01755004624569455, 0.012550386671737955, 0.017924305774952437, -0.007309161310274521,
+         0.03150097858285519},
+        {0.9999999999999998, 0.16666666666689706, 0.07499999995624415, 0.04464286038603156, 0.030381820752221768,
+         0.022374928823605693, 0.017313700945909897, 0.01432423514994457, 0.009376473481056654, 0.01825637024213353,
+         -0.011693559679531318, 0.03150477675162431},
+        {1.0, 0.16666666666664942, 0.07500000000385201, 0.044642856805998936, 0.03038195969768514,
+         0.022371749733164054, 0.01735977964134998, 0.01388484282640208, 0.012170138592391726, 0.0065293020047365695,
+         0.019513468251252167, -0.016187392271599134, 0.03187962140081284},
+    };
+
+#ifndef HAVERSINE_SIN_TERMS
+#define HAVERSINE_SIN_TERMS 9
+#endif
+#ifndef HAVERSINE_ASIN_TERMS
+#define HAVERSINE_ASIN_TERMS 13
+#endif
+
+    template <uint32_t Terms>
+    constexpr double const *sin_fit() {
+        static_assert((Terms >= HAVERSINE_SIN_MIN_TERMS) && (Terms <= HAVERSINE_SIN_MAX_TERMS), "no sin fit with that many terms");
+        return haversine_sin_fits[Terms - HAVERSINE_SIN_MIN_TERMS];
+    }
+
+    template <uint32_t Terms>
+    constexpr double const *asin_fit() {
+        static_assert((Terms >= HAVERSINE_ASIN_MIN_TERMS) && (Terms <= HAVERSINE_ASIN_MAX_TERMS), "no asin fit with that many terms");
+        return haversine_asin_fits[Terms - HAVERSINE_ASIN_MIN_TERMS];
+    }
+
+    // Scalar versions of the approximations, over the whole domain the
+    // haversine feeds each function. They mirror the SIMD code lane for lane
+    // and are what --math-check measures.
+    static inline double evaluate_polynomial(double t, double const *coefficients, uint32_t count) {
+        double result = coefficients[count - 1];
+        for (uint32_t i = count - 1; i > 0; --i) {
+            result = result * t + coefficients[i - 1];
+        }
+        return result;
+    }
+
+    // x in [-pi, pi]
+    template <uint32_t Terms = HAVERSINE_SIN_TERMS>
+    static inline double sin_approx(double x) {
+        double ax = fabs(x);
+        ax = fmin(ax, (PI64 - ax) + PI64_LOW);
+        double result = ax * evaluate_polynomial(ax * ax, sin_fit<Terms>(), Terms);
+        return copysign(result, x);
+    }
+
+    // x in [-pi/2, pi/2]
+    template <uint32_t Terms = HAVERSINE_SIN_TERMS>
+    static inline double cos_approx(double x) {
+        double u = (HALF_PI64 - fabs(x)) + HALF_PI64_LOW;
+        return u * evaluate_polynomial(u * u, sin_fit<Terms>(), Terms);
+    }
+
+    // x in [0, 1]
+    template <uint32_t Terms = HAVERSINE_ASIN_TERMS>
+    static inline double asin_approx(double x) {
+        double result = 0;
+        if (x > 0.5) {
+            double t = (1.0 - x) * 0.5;
+            result = HALF_PI64 - 2.0 * sqrt(t) * evaluate_polynomial(t, asin_fit<Terms>(), Terms);
+        } else {
+            result = x * evaluate_polynomial(x * x, asin_fit<Terms>(), Terms);
+        }
+        return result;
+    }
+
+    // NOTE: square root is the one function the hardware already does in a
+    // single, correctly rounded instruction, so the kernels use vsqrtpd. This
+    // Newton-Raphson version (bit-trick reciprocal square root estimate, then
+    // `Steps` refinements) exists so --math-check can show what replacing it
+    // would buy. x in [0, 1].
+    template <uint32_t Steps>
+    static inline double sqrt_approx(double x) {
+        uint64_t bits = 0;
+        memcpy(&bits, &x, sizeof(bits));
+        bits = 0x5FE6EB50C7B537A9ull - (bits >> 1);
+        double y = 0;
+        memcpy(&y, &bits, sizeof(y));
+        for (uint32_t i = 0; i < Steps; ++i) {
+            y = y * (1.5 - 0.5 * x * y * y);
+        }
+        return x * y;
+    }
+
+    // Sums the distances (not the average) of `count` pairs starting at
+    // `first`, which must be a multiple of HAVERSINE_LANE_PADDING. The SIMD
+    // kernels may run past pairs->count up to the padded count, which is fine
+    // because padding pairs are all zero.
+    typedef double (*haversine_sum_fn)(haversine_pairs_soa const *pairs, uint64_t first, uint64_t count);
+
+    static double sum_haversine_soa_scalar(haversine_pairs_soa const *pairs, uint64_t first, uint64_t count) {
+        double sum = 0;
+        uint64_t end = first + count;
+        if (end > pairs->count) {
+            end = pairs->count;
+        }
+        for (uint64_t i = first; i < end; ++i) {
+            sum += ReferenceHaversine(pairs->x0[i], pairs->y0[i], pairs->x1[i], pairs->y1[i], EARTH_RADIUS);
+        }
+        return sum;
+    }
+
+    __attribute__((target("avx2,fma"))) static inline __m256d evaluate_polynomial_avx2(__m256d t, double const *coefficients, uint32_t count) {
+        __m256d result = _mm256_set1_pd(coefficients[count - 1]);
+        for (uint32_t i = count - 1; i > 0; --i) {
+            result = _mm256_fmadd_pd(result, t, _mm256_set1_pd(coefficients[i - 1]));
+        }
+        return result;
+    }
+
+    // x in [0, pi/2]
+    template <uint32_t Terms>
+    __attribute__((target("avx2,fma"))) static inline __m256d sin_avx2(__m256d x) {
+        __m256d s = evaluate_polynomial_avx2(_mm256_mul_pd(x, x), sin_fit<Terms>(), Terms);
+        return _mm256_mul_pd(x, s);
+    }
+
+    // x in [0, 1]
+    template <uint32_t Terms>
+    __attribute__((target("avx2,fma"))) static inline __m256d asin_avx2(__m256d x) {
+        __m256d half = _mm256_set1_pd(0.5);
+        __m256d is_large = _mm256_cmp_pd(x, half, _CMP_GT_OQ);
+        __m256d reflected = _mm256_mul_pd(_mm256_sub_pd(_mm256_set1_pd(1.0), x), half);
+        __m256d t = _mm256_blendv_pd(_mm256_mul_pd(x, x), reflected, is_large);
+        __m256d r = _mm256_blendv_pd(x, _mm256_sqrt_pd(reflected), is_large);
+        __m256d a = _mm256_mul_pd(r, evaluate_polynomial_avx2(t, asin_fit<Terms>(), Terms));
+        __m256d large = _mm256_fnmadd_pd(_mm256_set1_pd(2.0), a, _mm256_set1_pd(HALF_PI64));
+        return _mm256_blendv_pd(a, large, is_large);
+    }
+
+    template <uint32_t SinTerms = HAVERSINE_SIN_TERMS, uint32_t AsinTerms = HAVERSINE_ASIN_TERMS>
+    __attribute__((target("avx2,fma"))) static double sum_haversine_soa_avx2(haversine_pairs_soa const *pairs, uint64_t first, uint64_t count) {
+        __m256d half_radians_per_degree = _mm256_set1_pd(0.5 * 0.01745329251994329577);
+        __m256d radians_per_degree = _mm256_set1_pd(0.01745329251994329577);
+        __m256d abs_mask = _mm256_castsi256_pd(_mm256_set1_epi64x(0x7FFFFFFFFFFFFFFFll));
+        __m256d pi = _mm256_set1_pd(PI64);
+        __m256d pi_low = _mm256_set1_pd(PI64_LOW);
+        __m256d half_pi = _mm256_set1_pd(HALF_PI64);
+        __m256d half_pi_low = _mm256_set1_pd(HALF_PI64_LOW);
+        __m256d diameter = _mm256_set1_pd(2.0 * EARTH_RADIUS);
+
+        __m256d sum = _mm256_setzero_pd();
+        uint64_t end = first + pad_pair_count(count);
+        for (uint64_t i = first; i < end; i += 4) {
+            __m256d x0 = _mm256_load_pd(pairs->x0 + i);
+            __m256d y0 = _mm256_load_pd(pairs->y0 + i);
+            __m256d x1 = _mm256_load_pd(pairs->x1 + i);
+            __m256d y1 = _mm256_load_pd(pairs->y1 + i);
+
+            __m256d half_dlat = _mm256_and_pd(_mm256_mul_pd(_mm256_sub_pd(y1, y0), half_radians_per_degree), abs_mask);
+            __m256d half_dlon = _mm256_and_pd(_mm256_mul_pd(_mm256_sub_pd(x1, x0), half_radians_per_degree), abs_mask);
+            half_dlon = _mm256_min_pd(half_dlon, _mm256_add_pd(_mm256_sub_pd(pi, half_dlon), pi_low));
+            __m256d lat0 = _mm256_and_pd(_mm256_mul_pd(y0, radians_per_degree), abs_mask);
+            __m256d lat1 = _mm256_and_pd(_mm256_mul_pd(y1, radians_per_degree), abs_mask);
+
+            __m256d sin_dlat = sin_avx2<SinTerms>(half_dlat);
+            __m256d sin_dlon = sin_avx2<SinTerms>(half_dlon);
+            __m256d cos_lat0 = sin_avx2<SinTerms>(_mm256_add_pd(_mm256_sub_pd(half_pi, lat0), half_pi_low));
+            __m256d cos_lat1 = sin_avx2<SinTerms>(_mm256_add_pd(_mm256_sub_pd(half_pi, lat1), half_pi_low));
+
+            __m256d a = _mm256_mul_pd(_mm256_mul_pd(cos_lat0, cos_lat1), _mm256_mul_pd(sin_dlon, sin_dlon));
+            a = _mm256_fmadd_pd(sin_dlat, sin_dlat, a);
+            __m256d c = asin_avx2<AsinTerms>(_mm256_sqrt_pd(a));
+            sum = _mm256_fmadd_pd(diameter, c, sum);
+        }
+
+        alignas(32) double lanes[4];
+        _mm256_store_pd(lanes, sum);
+        double result = ((lanes[0] + lanes[1]) + (lanes[2] + lanes[3]));
+        return result;
+    }
+
+    __attribute__((target("avx512f"))) static inline __m512d evaluate_polynomial_avx512(__m512d t, double const *coefficients, uint32_t count) {
+        __m512d result = _mm512_set1_pd(coefficients[count - 1]);
+        for (uint32_t i = count - 1; i > 0; --i) {
+            result = _mm512_fmadd_pd(result, t, _mm512_set1_pd(coefficients[i - 1]));
+        }
+        return result;
+    }
+
+    // NOTE: the unmasked sqrt/min intrinsics start from _mm512_undefined_pd,
+    // which GCC 12 reports as maybe-uninitialized; the zero-masked forms with
+    // every lane selected are the same instruction without the warning.
+    __attribute__((target("avx512f"))) static inline __m512d sqrt_avx512(__m512d x) {
+        return _mm512_maskz_sqrt_pd(0xFF, x);
+    }
+
+    template <uint32_t Terms>
+    __attribute__((target("avx512f"))) static inline __m512d sin_avx512(__m512d x) {
+        __m512d s = evaluate_polynomial_avx512(_mm512_mul_pd(x, x), sin_fit<Terms>(), Terms);
+        return _mm512_mul_pd(x, s);
+    }
+
+    template <uint32_t Terms>
+    __attribute__((target("avx512f"))) static inline __m512d asin_avx512(__m512d x) {
+        __m512d half = _mm512_set1_pd(0.5);
+        __mmask8 is_large = _mm512_cmp_pd_mask(x, half, _CMP_GT_OQ);
+        __m512d reflected = _mm512_mul_pd(_mm512_sub_pd(_mm512_set1_pd(1.0), x), half);
+        __m512d t = _mm512_mask_blend_pd(is_large, _mm512_mul_pd(x, x), reflected);
+        __m512d r = _mm512_mask_blend_pd(is_large, x, sqrt_avx512(reflected));
+        __m512d a = _mm512_mul_pd(r, evaluate_polynomial_avx512(t, asin_fit<Terms>(), Terms));
+        __m512d large = _mm512_fnmadd_pd(_mm512_set1_pd(2.0), a, _mm512_set1_pd(HALF_PI64));
+        return _mm512_mask_blend_pd(is_large, a, large);
+    }
+
+    template <uint32_t SinTerms = HAVERSINE_SIN_TERMS, uint32_t AsinTerms = HAVERSINE_ASIN_TERMS>
+    __attribute__((target("avx512f"))) static double sum_haversine_soa_avx512(haversine_pairs_soa const *pairs, uint64_t first, uint64_t count) {
+        __m512d half_radians_per_degree = _mm512_set1_pd(0.5 * 0.01745329251994329577);
+        __m512d radians_per_degree = _mm512_set1_pd(0.01745329251994329577);
+        __m512d pi = _mm512_set1_pd(PI64);
+        __m512d pi_low = _mm512_set1_pd(PI64_LOW);
+        __m512d half_pi = _mm512_set1_pd(HALF_PI64);
+        __m512d half_pi_low = _mm512_set1_pd(HALF_PI64_LOW);
+        __m512d diameter = _mm512_set1_pd(2.0 * EARTH_RADIUS);
+
+        __m512d sum = _mm512_setzero_pd();
+        uint64_t end = first + pad_pair_count(count);
+        for (uint64_t i = first; i < end; i += 8) {
+            __m512d x0 = _mm512_load_pd(pairs->x0 + i);
+            __m512d y0 = _mm512_load_pd(pairs->y0 + i);
+            __m512d x1 = _mm512_load_pd(pairs->x1 + i);
+            __m512d y1 = _mm512_load_pd(pairs->y1 + i);
+
+            __m512d half_dlat = _mm512_abs_pd(_mm512_mul_pd(_mm512_sub_pd(y1, y0), half_radians_per_degree));
+            __m512d half_dlon = _mm512_abs_pd(_mm512_mul_pd(_mm512_sub_pd(x1, x0), half_radians_per_degree));
+            half_dlon = _mm512_maskz_min_pd(0xFF, half_dlon, _mm512_add_pd(_mm512_sub_pd(pi, half_dlon), pi_low));
+            __m512d lat0 = _mm512_abs_pd(_mm512_mul_pd(y0, radians_per_degree));
+            __m512d lat1 = _mm512_abs_pd(_mm512_mul_pd(y1, radians_per_degree));
+
+            __m512d sin_dlat = sin_avx512<SinTerms>(half_dlat);
+            __m512d sin_dlon = sin_avx512<SinTerms>(half_dlon);
+            __m512d cos_lat0 = sin_avx512<SinTerms>(_mm512_add_pd(_mm512_sub_pd(half_pi, lat0), half_pi_low));
+            __m512d cos_lat1 = sin_avx512<SinTerms>(_mm512_add_pd(_mm512_sub_pd(half_pi, lat1), half_pi_low));
+
+            __m512d a = _mm512_mul_pd(_mm512_mul_pd(cos_lat0, cos_lat1), _mm512_mul_pd(sin_dlon, sin_dlon));
+            a = _mm512_fmadd_pd(sin_dlat, sin_dlat, a);
+            __m512d c = asin_avx512<AsinTerms>(sqrt_avx512(a));
+            sum = _mm512_fmadd_pd(diameter, c, sum);
+        }
+
+        alignas(64) double lanes[8];
+        _mm512_store_pd(lanes, sum);
+        double result = (((lanes[0] + lanes[1]) + (lanes[2] + lanes[3])) + ((lanes[4] + lanes[5]) + (lanes[6] + lanes[7])));
+        return result;
+    }
+
+    // NOTE: floating-point addition is not associative, so a parallel sum is
+    // only reproducible if its grouping does not depend on the threads. The
+    // pairs are cut into fixed blocks of 1024 (32 KB of columns, so one block
+    // is L1-sized), each block is summed on its own into its own slot, and the
+    // slots are combined by a pairwise tree whose shape depends on the block
+    // count alone. Any thread count, including one, gives the same bits.
+    constexpr uint64_t HAVERSINE_SUM_BLOCK_PAIRS = 1024;
+    static_assert(HAVERSINE_SUM_BLOCK_PAIRS % HAVERSINE_LANE_PADDING == 0, "blocks must start on a lane boundary");
+
+    static double pairwise_sum(double const *values, uint64_t count) {
+        double result = 0;
+        if (count <= 8) {
+            for (uint64_t i = 0; i < count; ++i) {
+                result += values[i];
+            }
+        } else {
+            uint64_t half = count / 2;
+            result = pairwise_sum(values, half) + pairwise_sum(values + half, count - half);
+        }
+        return result;
+    }
+
+    // Pairwise summation fed one value at a time in O(log n) memory: like a
+    // binary counter, partial[level] holds the sum of the last 2^level values
+    // not yet merged upward. The tree only depends on the order of the values,
+    // not on how they were batched.
+    struct pairwise_accumulator {
+        double partial[64];
+        uint64_t count;
+    };
+
+    static void accumulate_pairwise(pairwise_accumulator *accumulator, double value) {
+        uint32_t level = 0;
+        for (; accumulator->count & (1ull << level); ++level) {
+            value = accumulator->partial[level] + value;
+        }
+        accumulator->partial[level] = value;
+        ++accumulator->count;
+    }
+
+    static double finish_pairwise(pairwise_accumulator const *accumulator) {
+        double result = 0;
+        for (uint32_t level = 0; level < 64; ++level) {
+            if (accumulator->count & (1ull << level)) {
+                result = accumulator->partial[level] + result;
+            }
+        }
+        return result;
+    }
+
+    struct haversine_sum_job {
+        haversine_pairs_soa const *pairs;
+        haversine_sum_fn sum_distances;
+        double *block_sums;
+    };
+
+    static void sum_haversine_block(void *context, uint64_t block_index) {
+        haversine_sum_job *job = (haversine_sum_job *)context;
+        uint64_t first = block_index * HAVERSINE_SUM_BLOCK_PAIRS;
+        uint64_t count = job->pairs->count - first;
+        if (count > HAVERSINE_SUM_BLOCK_PAIRS) {
+            count = HAVERSINE_SUM_BLOCK_PAIRS;
+        }
+        job->block_sums[block_index] = job->sum_distances(job->pairs, first, count);
+    }
+
+    static uint64_t get_sum_block_count(uint64_t pair_count) {
+        return (pair_count + HAVERSINE_SUM_BLOCK_PAIRS - 1) / HAVERSINE_SUM_BLOCK_PAIRS;
+    }
+
+    // NOTE: block_sums needs get_sum_block_count(pairs->count) entries.
+    static void sum_haversine_block_sums(thread_pool *pool, haversine_pairs_soa const *pairs, haversine_sum_fn sum_distances,
+                                         double *block_sums) {
+        haversine_sum_job job = {pairs, sum_distances, block_sums};
+        run_tasks(pool, get_sum_block_count(pairs->count), sum_haversine_block, &job);
+    }
+
+    // Sums the distances of all pairs (not the average) on every thread of
+    // the pool.
+    static double sum_haversine_blocks(thread_pool *pool, haversine_pairs_soa const *pairs, haversine_sum_fn sum_distances) {
+        double result = 0;
+        uint64_t block_count = get_sum_block_count(pairs->count);
+        buffer block_sums = allocate_buffer(block_count * sizeof(double));
+        if (block_sums.data) {
+            sum_haversine_block_sums(pool, pairs, sum_distances, (double *)block_sums.data);
+            result = pairwise_sum((double *)block_sums.data, block_count);
+        }
+        free_buffer(&block_sums);
+        return result;
+    }
+
+    // NOTE: there is no SSE4.2 kernel; below AVX2 the scalar one is used.
+    static haversine_sum_fn select_haversine_sum(eIsaLevel level) {
+        haversine_sum_fn result = sum_haversine_soa_scalar;
+        if (level >= eIsaLevel::Avx512) {
+            result = sum_haversine_soa_avx512<>;
+        } else if (level >= eIsaLevel::Avx2) {
+            result = sum_haversine_soa_avx2<>;
+        }
+        return result;
+    }
+
+    static haversine_sum_fn global_haversine_sum = select_haversine_sum(get_best_isa_level());
+}
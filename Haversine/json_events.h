@@ -0,0 +1,272 @@
+#pragma once
+#include "json_parser.h"
+
+namespace json {
+
+// Event-driven (SAX style) interface over get_json_token. Instead of building
+// json_element nodes, parse_json_events reports each structural event to a
+// handler as it is read. Handlers derive from json_event_handler and hide the
+// events they care about; the calls are resolved at compile time.
+struct json_event_handler {
+    void on_object_begin() { }
+    void on_object_end() { }
+    void on_array_begin() { }
+    void on_array_end() { }
+    void on_key(buffer) { }
+    void on_number(buffer) { }
+    void on_string(buffer) { }
+    void on_literal(json_token) { }
+    // NOTE: lets a handler end the parse early once it has what it needs.
+    bool is_done() { return false; }
+};
+
+enum class eJsonEventState : uint8_t {
+    Value,
+    ValueOrEnd,
+    Key,
+    KeyOrEnd,
+    Colon,
+    AfterValue,
+    Done
+};
+
+constexpr uint32_t JSON_MAX_EVENT_DEPTH = 1024;
+
+// NOTE: nesting is tracked on an explicit stack rather than by recursion, so
+// adversarial inputs cannot overflow the call stack. Every token moves the
+// state machine by exactly one step.
+struct json_event_parser {
+    json_parser tokens;
+    eJsonEventState state;
+    uint32_t depth;
+    eJsonTokenType closers[JSON_MAX_EVENT_DEPTH];
+};
+
+template <typename Handler>
+void begin_json_value(json_event_parser* parser, json_token token, Handler* handler)
+{
+    switch (token.type) {
+    case eJsonTokenType::OpenBrace:
+    case eJsonTokenType::OpenBracket: {
+        if (parser->depth < JSON_MAX_EVENT_DEPTH) {
+            bool is_object = (token.type == eJsonTokenType::OpenBrace);
+            parser->closers[parser->depth++] = is_object ? eJsonTokenType::CloseBrace : eJsonTokenType::CloseBracket;
+            parser->state = is_object ? eJsonEventState::KeyOrEnd : eJsonEventState::ValueOrEnd;
+            if (is_object) {
+                handler->on_object_begin();
+            } else {
+                handler->on_array_begin();
+            }
+        } else {
+            error(&parser->tokens, token, "json nested too deeply");
+        }
+    } break;
+    case eJsonTokenType::Number: {
+        handler->on_number(token.value);
+        parser->state = eJsonEventState::AfterValue;
+    } break;
+    case eJsonTokenType::StringLiteral: {
+        handler->on_string(token.value);
+        parser->state = eJsonEventState::AfterValue;
+    } break;
+    case eJsonTokenType::True:
+    case eJsonTokenType::False:
+    case eJsonTokenType::Null: {
+        handler->on_literal(token);
+        parser->state = eJsonEventState::AfterValue;
+    } break;
+    default: {
+        error(&parser->tokens, token, "unexpected token in json");
+    } break;
+    }
+}
+
+template <typename Handler>
+void end_json_container(json_event_parser* parser, Handler* handler)
+{
+    eJsonTokenType closer = parser->closers[--parser->depth];
+    if (closer == eJsonTokenType::CloseBrace) {
+        handler->on_object_end();
+    } else {
+        handler->on_array_end();
+    }
+    parser->state = parser->depth ? eJsonEventState::AfterValue : eJsonEventState::Done;
+}
+
+template <typename Handler>
+bool parse_json_events(json_event_parser* parser, Handler* handler)
+{
+    while ((parser->state != eJsonEventState::Done) && is_parsing(&parser->tokens) && !handler->is_done()) {
+        json_token token = get_json_token(&parser->tokens);
+        if ((token.type == eJsonTokenType::EndOfStream) && parser->tokens.has_more_input) {
+            // NOTE: suspended; the caller resumes once it has more input.
+            break;
+        }
+        switch (parser->state) {
+        case eJsonEventState::ValueOrEnd: {
+            if (token.type == eJsonTokenType::CloseBracket) {
+                end_json_container(parser, handler);
+                break;
+            }
+        }
+            [[fallthrough]];
+        case eJsonEventState::Value: {
+            begin_json_value(parser, token, handler);
+            if ((parser->state == eJsonEventState::AfterValue) && !parser->depth) {
+                parser->state = eJsonEventState::Done;
+            }
+        } break;
+        case eJsonEventState::KeyOrEnd: {
+            if (token.type == eJsonTokenType::CloseBrace) {
+                end_json_container(parser, handler);
+                break;
+            }
+        }
+            [[fallthrough]];
+        case eJsonEventState::Key: {
+            if (token.type == eJsonTokenType::StringLiteral) {
+                handler->on_key(token.value);
+                parser->state = eJsonEventState::Colon;
+            } else {
+                error(&parser->tokens, token, "unexpected token in json");
+            }
+        } break;
+        case eJsonEventState::Colon: {
+            if (token.type == eJsonTokenType::Colon) {
+                parser->state = eJsonEventState::Value;
+            } else {
+                error(&parser->tokens, token, "Expected colon after field name");
+            }
+        } break;
+        case eJsonEventState::AfterValue: {
+            eJsonTokenType closer = parser->closers[parser->depth - 1];
+            if (token.type == eJsonTokenType::Comma) {
+                parser->state = (closer == eJsonTokenType::CloseBrace) ? eJsonEventState::Key : eJsonEventState::Value;
+            } else if (token.type == closer) {
+                end_json_container(parser, handler);
+            } else {
+                error(&parser->tokens, token, "unexpected token in json");
+            }
+        } break;
+        default:
+            break;
+        }
+    }
+
+    bool result = (parser->state == eJsonEventState::Done) && !parser->tokens.had_error;
+    return result;
+}
+
+template <typename Handler>
+bool parse_json_events(buffer input_json, Handler* handler)
+{
+    json_structural_index index;
+    init_structural_index(&index, input_json);
+
+    json_event_parser parser = {};
+    parser.tokens.source = input_json;
+    parser.tokens.index = &index;
+    parser.state = eJsonEventState::Value;
+    bool result = parse_json_events(&parser, handler);
+    return result;
+}
+
+// Pulls the four coordinates of every object in the top-level "pairs" array
+// straight into the output as their numbers are read. Keys are matched with
+// the haversine_pair json_schema. Unknown keys and any deeper nesting are
+// skipped, and so is a field that already came up in the same object: the
+// first occurrence wins, as in read_json_record. For the same reason only the
+// first top-level "pairs" array is read, the one lookup_element finds.
+template <typename Sink>
+struct haversine_pair_extractor : json_event_handler {
+    Sink* output;
+
+    uint32_t depth;
+    uint32_t pairs_depth;
+    bool last_key_was_pairs;
+    bool has_read_pairs;
+    double* field;
+    uint32_t seen;
+    haversine_pair current;
+    json_record_matcher<haversine_pair> matcher;
+
+    bool is_in_pair() { return pairs_depth && (depth == pairs_depth + 1); }
+
+    void on_object_begin()
+    {
+        ++depth;
+        if (is_in_pair()) {
+            current = {};
+            field = nullptr;
+            seen = 0;
+            matcher = {};
+        }
+    }
+
+    void on_object_end()
+    {
+        if (is_in_pair()) {
+            push_pair(output, current);
+        }
+        --depth;
+    }
+
+    void on_array_begin()
+    {
+        ++depth;
+        if ((depth == 2) && last_key_was_pairs && !has_read_pairs) {
+            pairs_depth = depth;
+        }
+    }
+
+    void on_array_end()
+    {
+        if (depth == pairs_depth) {
+            pairs_depth = 0;
+            has_read_pairs = true;
+        }
+        --depth;
+    }
+
+    void on_key(buffer key)
+    {
+        if (depth == 1) {
+            last_key_was_pairs = are_equal(key, CONSTANT_STRING("pairs"));
+        } else if (is_in_pair()) {
+            field = nullptr;
+            uint32_t field_index = match_schema_key(&matcher, key);
+            if ((field_index < SCHEMA_FIELD_COUNT<haversine_pair>) && !(seen & (1u << field_index))) {
+                seen |= 1u << field_index;
+                field = &(current.*get_schema_member<haversine_pair>(field_index));
+            }
+        }
+    }
+
+    void on_number(buffer value)
+    {
+        if (field && is_in_pair()) {
+            *field = convert_number_to_double(value);
+            field = nullptr;
+        }
+    }
+};
+
+template <typename Sink>
+void parse_haversine_pairs_events(buffer input_json, Sink* output)
+{
+    TIME_BANDWIDTH(__func__, input_json.count);
+    haversine_pair_extractor<Sink> extractor = {};
+    extractor.output = output;
+    parse_json_events(input_json, &extractor);
+}
+
+// NOTE: same result as parse_haversine_pairs, but no json_element tree is
+// ever built, so the input is only walked once.
+uint64_t parse_haversine_pairs_events(buffer input_json, uint64_t max_pair_count, haversine_pair* pairs)
+{
+    haversine_pair_array output = { pairs, max_pair_count, 0 };
+    parse_haversine_pairs_events(input_json, &output);
+    return output.count;
+}
+
+} // namespace json
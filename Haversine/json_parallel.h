@@ -0,0 +1,337 @@
+#pragma once
+#include "json_events.h"
+#include "thread_pool.h"
+
+namespace json {
+
+// Parallel version of parse_haversine_pairs_events. The top-level "pairs"
+// array is cut into slices at element boundaries, each slice is parsed on its
+// own thread into its own window of the output, and the windows are then
+// compacted in order, so the result is exactly what the sequential parser
+// produces. Finding the cuts takes two parallel passes over the input:
+//   1. every chunk is summarized without knowing its starting state: its
+//      quote parity and its bracket depth profile, for both the case where it
+//      starts outside a string and the one where it starts inside one;
+//   2. a sequential prefix over the summaries gives the real string state and
+//      depth at each chunk start, and every chunk then looks for the first
+//      object directly inside the pairs array, which is usually a few bytes
+//      away.
+// If anything does not line up (an input that is not well formed, or output
+// too small for the slices), the whole input is parsed sequentially instead so
+// errors are reported exactly as before.
+constexpr uint64_t JSON_MIN_PARALLEL_CHUNK = 256 * 1024;
+constexpr uint32_t JSON_CHUNKS_PER_THREAD = 4;
+constexpr int64_t JSON_PAIRS_ARRAY_DEPTH = 2;
+constexpr uint64_t JSON_NO_SPLIT = (uint64_t)-1;
+
+struct json_chunk {
+    uint64_t begin;
+    uint64_t end;
+
+    // NOTE: indexed by whether the chunk starts inside a string.
+    bool flips_string;
+    int64_t depth_change[2];
+    int64_t min_depth[2];
+
+    bool starts_in_string;
+    bool starts_in_pairs;
+    int64_t start_depth;
+    uint64_t split;
+};
+
+struct json_slice {
+    uint64_t begin;
+    uint64_t end;
+    haversine_pairs_region output;
+    bool is_valid;
+};
+
+struct json_parallel_parse {
+    buffer source;
+    json_chunk* chunks;
+    uint64_t chunk_count;
+    json_slice* slices;
+    uint64_t slice_count;
+};
+
+// Stops the parse right after the '[' that opens the top-level "pairs" array.
+struct haversine_pairs_locator : json_event_handler {
+    uint32_t depth;
+    bool last_key_was_pairs;
+    bool found;
+
+    void on_object_begin() { ++depth; }
+    void on_object_end() { --depth; }
+    void on_array_begin()
+    {
+        ++depth;
+        found = (depth == JSON_PAIRS_ARRAY_DEPTH) && last_key_was_pairs;
+    }
+    void on_array_end() { --depth; }
+    void on_key(buffer key)
+    {
+        if (depth == 1) {
+            last_key_was_pairs = are_equal(key, CONSTANT_STRING("pairs"));
+        }
+    }
+    bool is_done() { return found; }
+};
+
+bool is_open_bracket(uint8_t c)
+{
+    return (c == '{') || (c == '[');
+}
+
+void summarize_json_chunk(void* context, uint64_t chunk_index)
+{
+    json_parallel_parse* job = (json_parallel_parse*)context;
+    json_chunk* chunk = job->chunks + chunk_index;
+    int64_t depth[2] = {};
+    int64_t min_depth[2] = {};
+    chunk->flips_string = walk_json_brackets(job->source, chunk->begin, chunk->end,
+        [&](uint64_t, uint8_t c, bool in_string) {
+            // NOTE: a bracket that is inside a string when the chunk starts
+            // outside one is outside a string when it starts inside one.
+            uint32_t starts_in_string = in_string;
+            if (is_open_bracket(c)) {
+                ++depth[starts_in_string];
+            } else if (--depth[starts_in_string] < min_depth[starts_in_string]) {
+                min_depth[starts_in_string] = depth[starts_in_string];
+            }
+            return true;
+        });
+    for (uint32_t i = 0; i < 2; ++i) {
+        chunk->depth_change[i] = depth[i];
+        chunk->min_depth[i] = min_depth[i];
+    }
+}
+
+void find_json_chunk_split(void* context, uint64_t chunk_index)
+{
+    json_parallel_parse* job = (json_parallel_parse*)context;
+    json_chunk* chunk = job->chunks + chunk_index;
+    chunk->split = JSON_NO_SPLIT;
+    if (chunk_index && chunk->starts_in_pairs) {
+        int64_t depth = chunk->start_depth;
+        walk_json_brackets(job->source, chunk->begin, chunk->end,
+            [&](uint64_t position, uint8_t c, bool in_string) {
+                bool result = true;
+                if (in_string == chunk->starts_in_string) {
+                    if (is_open_bracket(c)) {
+                        if ((c == '{') && (depth == JSON_PAIRS_ARRAY_DEPTH)) {
+                            chunk->split = position;
+                            result = false;
+                        }
+                        ++depth;
+                    } else if (--depth < JSON_PAIRS_ARRAY_DEPTH) {
+                        result = false;
+                    }
+                }
+                return result;
+            });
+    }
+}
+
+void parse_json_slice(void* context, uint64_t slice_index)
+{
+    json_parallel_parse* job = (json_parallel_parse*)context;
+    json_slice* slice = job->slices + slice_index;
+    bool is_last = (slice_index + 1 == job->slice_count);
+
+    buffer source = job->source;
+    source.count = slice->end;
+    json_structural_index index;
+    init_structural_index(&index, source, slice->begin);
+
+    json_event_parser parser = {};
+    parser.tokens.source = source;
+    parser.tokens.at = slice->begin;
+    parser.tokens.index = &index;
+    parser.tokens.is_quiet = true;
+    parser.state = eJsonEventState::Value;
+
+    haversine_pair_extractor<haversine_pairs_region> extractor = {};
+    extractor.output = &slice->output;
+    if (slice_index) {
+        // NOTE: every slice but the first starts right after a comma between
+        // two elements of the pairs array.
+        parser.depth = JSON_PAIRS_ARRAY_DEPTH;
+        parser.closers[0] = eJsonTokenType::CloseBrace;
+        parser.closers[1] = eJsonTokenType::CloseBracket;
+        extractor.depth = JSON_PAIRS_ARRAY_DEPTH;
+        extractor.pairs_depth = JSON_PAIRS_ARRAY_DEPTH;
+    }
+
+    bool is_done = parse_json_events(&parser, &extractor);
+    if (is_last) {
+        slice->is_valid = is_done;
+    } else {
+        slice->is_valid = !parser.tokens.had_error && (parser.state == eJsonEventState::Value)
+            && (parser.depth == JSON_PAIRS_ARRAY_DEPTH) && (extractor.pairs_depth == JSON_PAIRS_ARRAY_DEPTH);
+    }
+    // NOTE: a slice's room is only estimated from its size, and objects with
+    // fewer fields than a pair can still overrun it. The sequential parse is
+    // not held to that estimate, so the whole input goes to it instead.
+    slice->is_valid = slice->is_valid && !slice->output.is_overflowed;
+}
+
+// Returns the position just after the comma before the element at `split`,
+// or JSON_NO_SPLIT if there is none.
+uint64_t find_slice_start(buffer source, uint64_t split)
+{
+    uint64_t result = JSON_NO_SPLIT;
+    uint64_t at = split;
+    while (at && is_json_whitespace(source, at - 1)) {
+        --at;
+    }
+    if (at && (source.data[at - 1] == ',')) {
+        result = at;
+    }
+    return result;
+}
+
+bool try_parse_haversine_pairs_parallel(lsp::thread_pool* pool, buffer input_json, haversine_pairs_soa* output)
+{
+    bool result = false;
+
+    json_structural_index index;
+    init_structural_index(&index, input_json);
+    json_event_parser locator_parser = {};
+    locator_parser.tokens.source = input_json;
+    locator_parser.tokens.index = &index;
+    locator_parser.tokens.is_quiet = true;
+    locator_parser.state = eJsonEventState::Value;
+    haversine_pairs_locator locator = {};
+    parse_json_events(&locator_parser, &locator);
+    if (!locator.found) {
+        return result;
+    }
+
+    uint64_t pairs_begin = locator_parser.tokens.at;
+    uint64_t region = input_json.count - pairs_begin;
+    uint64_t target_chunk_count = (uint64_t)lsp::get_thread_count(pool) * JSON_CHUNKS_PER_THREAD;
+    uint64_t chunk_size = (region + target_chunk_count - 1) / target_chunk_count;
+    if (chunk_size < JSON_MIN_PARALLEL_CHUNK) {
+        chunk_size = JSON_MIN_PARALLEL_CHUNK;
+    }
+    chunk_size = (chunk_size + 63) & ~63ull;
+    uint64_t chunk_count = (region + chunk_size - 1) / chunk_size;
+    if (chunk_count < 2) {
+        return result;
+    }
+
+    buffer chunk_memory = allocate_buffer(chunk_count * sizeof(json_chunk));
+    buffer slice_memory = allocate_buffer(chunk_count * sizeof(json_slice));
+    if (chunk_memory.data && slice_memory.data) {
+        json_parallel_parse job = {};
+        job.source = input_json;
+        job.chunks = (json_chunk*)chunk_memory.data;
+        job.chunk_count = chunk_count;
+        job.slices = (json_slice*)slice_memory.data;
+        for (uint64_t i = 0; i < chunk_count; ++i) {
+            json_chunk* chunk = job.chunks + i;
+            *chunk = {};
+            chunk->begin = pairs_begin + i * chunk_size;
+            chunk->end = (i + 1 == chunk_count) ? input_json.count : (chunk->begin + chunk_size);
+        }
+
+        lsp::run_tasks(pool, chunk_count, summarize_json_chunk, &job);
+
+        bool in_string = false;
+        bool in_pairs = true;
+        int64_t depth = JSON_PAIRS_ARRAY_DEPTH;
+        for (uint64_t i = 0; i < chunk_count; ++i) {
+            json_chunk* chunk = job.chunks + i;
+            chunk->starts_in_string = in_string;
+            chunk->starts_in_pairs = in_pairs;
+            chunk->start_depth = depth;
+            if (depth + chunk->min_depth[in_string] < JSON_PAIRS_ARRAY_DEPTH) {
+                in_pairs = false;
+            }
+            depth += chunk->depth_change[in_string];
+            in_string ^= chunk->flips_string;
+        }
+
+        lsp::run_tasks(pool, chunk_count, find_json_chunk_split, &job);
+
+        job.slices[0] = {};
+        job.slice_count = 1;
+        for (uint64_t i = 1; i < chunk_count; ++i) {
+            uint64_t split = job.chunks[i].split;
+            uint64_t start = (split != JSON_NO_SPLIT) ? find_slice_start(input_json, split) : JSON_NO_SPLIT;
+            if ((start != JSON_NO_SPLIT) && (start > job.slices[job.slice_count - 1].begin)) {
+                job.slices[job.slice_count - 1].end = start;
+                json_slice* slice = job.slices + job.slice_count++;
+                *slice = {};
+                slice->begin = start;
+            }
+        }
+        job.slices[job.slice_count - 1].end = input_json.count;
+
+        uint64_t first = 0;
+        for (uint64_t i = 0; i < job.slice_count; ++i) {
+            json_slice* slice = job.slices + i;
+            slice->output.pairs = output;
+            slice->output.first = first;
+            slice->output.max_count = (slice->end - slice->begin) / HAVERSINE_MIN_JSON_PAIR_BYTES;
+            slice->output.committed = 0;
+            if (output->committed > first) {
+                uint64_t committed = output->committed - first;
+                slice->output.committed = (committed < slice->output.max_count) ? committed : slice->output.max_count;
+            }
+            first += slice->output.max_count;
+        }
+
+        if ((job.slice_count > 1) && (first <= output->capacity)) {
+            lsp::run_tasks(pool, job.slice_count, parse_json_slice, &job);
+
+            result = true;
+            for (uint64_t i = 0; i < job.slice_count; ++i) {
+                result = result && job.slices[i].is_valid;
+            }
+            if (result) {
+                // NOTE: the slices only committed the ranges they wrote. Each
+                // one is moved into a committed prefix and then given back, so
+                // a reserved SoA never holds much more than the pairs.
+                uint64_t count = 0;
+                for (uint64_t i = 0; result && (i < job.slice_count); ++i) {
+                    haversine_pairs_region region = job.slices[i].output;
+                    result = grow_pairs_soa(output, pad_pair_count(count + region.count));
+                    if (result) {
+                        uint64_t bytes = region.count * sizeof(double);
+                        memmove(output->x0 + count, output->x0 + region.first, bytes);
+                        memmove(output->y0 + count, output->y0 + region.first, bytes);
+                        memmove(output->x1 + count, output->x1 + region.first, bytes);
+                        memmove(output->y1 + count, output->y1 + region.first, bytes);
+                        count += region.count;
+                        uint64_t first = (region.first > output->committed) ? region.first : output->committed;
+                        if (region.first + region.committed > first) {
+                            decommit_pairs_range(output, first, region.first + region.committed - first);
+                        }
+                    }
+                }
+                output->count = count;
+            }
+        }
+    }
+    free_buffer(&slice_memory);
+    free_buffer(&chunk_memory);
+    return result;
+}
+
+// NOTE: with one thread, or an input too small to be worth splitting, this is
+// just parse_haversine_pairs_events.
+void parse_haversine_pairs_parallel(lsp::thread_pool* pool, buffer input_json, haversine_pairs_soa* output)
+{
+    TIME_BANDWIDTH(__func__, input_json.count);
+    bool is_parsed = false;
+    if ((lsp::get_thread_count(pool) > 1) && (input_json.count >= 2 * JSON_MIN_PARALLEL_CHUNK)) {
+        is_parsed = try_parse_haversine_pairs_parallel(pool, input_json, output);
+    }
+    if (!is_parsed) {
+        output->count = 0;
+        parse_haversine_pairs_events(input_json, output);
+    }
+}
+
+} // namespace json
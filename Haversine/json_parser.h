@@ -1,59 +1,18 @@
 #pragma once
+#include "arena.h"
+#include "buffer.h"
 #include "common.h"
+#include "json_scanner.h"
+#include "json_powers_of_five.h"
+#include "json_schema.h"
+#include "profiler.h"
+#include <bit>
+#include <charconv>
 #include <cmath>
 #include <cstdint>
+#include <cstring>
 #include <iomanip>
 #include <iostream>
-struct buffer {
-    size_t count;
-    uint8_t* data;
-};
-
-#define CONSTANT_STRING(string) \
-    buffer { sizeof(string) - 1, (uint8_t*)(string) }
-
-bool is_in_bounds(buffer source, uint64_t at)
-{
-    bool result = (at < source.count);
-    return result;
-}
-
-bool are_equal(buffer a, buffer b)
-{
-    if (a.count != b.count) {
-        return false;
-    }
-
-    for (uint64_t i = 0; i < a.count; ++i) {
-        if (a.data[i] != b.data[i]) {
-            return false;
-        }
-    }
-
-    return true;
-}
-
-buffer allocate_buffer(size_t count)
-{
-    buffer res = {};
-    res.data = (uint8_t*)malloc(count);
-    if (res.data) {
-        res.count = count;
-    } else {
-        fprintf(stderr, "ERROR: Unable to allocate %llu bytes.\n", count);
-    }
-
-    return res;
-}
-
-void free_buffer(buffer* buffer)
-{
-    if (buffer->data) {
-        free(buffer->data);
-    }
-    *buffer = {};
-}
-
 namespace json {
 enum class eJsonTokenType {
     EndOfStream,
@@ -90,26 +49,60 @@ struct json_parser {
     buffer source;
     uint64_t at;
     bool had_error;
+    bool is_quiet;
+    // NOTE: set when `source` is only the part of the input read so far.
+    // A token that runs into the end of it may be cut short, so instead of
+    // being returned it is left unread and EndOfStream is returned; the
+    // caller appends more input and asks again.
+    bool has_more_input;
+    memory_arena* nodes;
+    json_structural_index* index;
 };
 
-bool is_json_digit(buffer source, uint64_t at)
+// NOTE: the tokenizer classifies bytes with one table lookup instead of a
+// chain of compares, and without bounds checks: every input it scans ends in
+// a byte that is in none of the classes a loop continues on (the zero padding
+// of allocate_buffer, map_buffer and stream chunks, or the separator that
+// ends a parallel slice), so each loop stops at the end of the input by
+// itself. Zero stops a string scan so that it cannot run on either.
+constexpr uint8_t JSON_DIGIT_CLASS = 0x01;
+constexpr uint8_t JSON_SPACE_CLASS = 0x02;
+constexpr uint8_t JSON_STRING_STOP_CLASS = 0x04;
+constexpr uint8_t JSON_NUMBER_CLASS = 0x08;
+
+struct json_byte_class_table {
+    uint8_t classes[256];
+};
+
+constexpr json_byte_class_table make_json_byte_classes()
 {
-    bool res = false;
-    if (is_in_bounds(source, at)) {
-        uint8_t value = source.data[at];
-        res = ((value >= '0') && (value <= '9'));
+    json_byte_class_table result = {};
+    for (uint32_t c = '0'; c <= '9'; ++c) {
+        result.classes[c] = JSON_DIGIT_CLASS | JSON_NUMBER_CLASS;
     }
-    return res;
+    for (uint8_t c : { '.', 'e', 'E', '+', '-' }) {
+        result.classes[c] = JSON_NUMBER_CLASS;
+    }
+    for (uint8_t c : { ' ', '\t', '\n', '\r' }) {
+        result.classes[c] = JSON_SPACE_CLASS;
+    }
+    for (uint8_t c : { '"', '\\', '\0' }) {
+        result.classes[c] = JSON_STRING_STOP_CLASS;
+    }
+    return result;
+}
+
+constexpr json_byte_class_table json_byte_classes = make_json_byte_classes();
+
+// NOTE: `at` may be source.count, the first byte of the padding.
+bool is_json_digit(buffer source, uint64_t at)
+{
+    return json_byte_classes.classes[source.data[at]] & JSON_DIGIT_CLASS;
 }
 
 bool is_json_whitespace(buffer source, uint64_t at)
 {
-    bool res = false;
-    if (is_in_bounds(source, at)) {
-        uint8_t value = source.data[at];
-        res = ((value == ' ') || (value == '\t') || (value == '\n') || (value == '\r'));
-    }
-    return res;
+    return json_byte_classes.classes[source.data[at]] & JSON_SPACE_CLASS;
 }
 
 bool is_parsing(json_parser* parser)
@@ -121,9 +114,11 @@ bool is_parsing(json_parser* parser)
 void error(json_parser* parser, json_token token, char const* message)
 {
     parser->had_error = true;
-    fprintf(stderr, "Error: \"%.*s\" - %s\n",
-        static_cast<uint32_t>(token.value.count),
-        reinterpret_cast<char*>(token.value.data), message);
+    if (!parser->is_quiet) {
+        fprintf(stderr, "Error: \"%.*s\" - %s\n",
+            static_cast<uint32_t>(token.value.count),
+            reinterpret_cast<char*>(token.value.data), message);
+    }
 }
 
 void parse_keyword(buffer source, uint64_t* at, buffer keyword_remaining,
@@ -147,8 +142,12 @@ json_token get_json_token(json_parser* parser)
     buffer source = parser->source;
     uint64_t at = parser->at;
 
-    while (is_json_whitespace(source, at)) {
-        ++at;
+    if (parser->index) {
+        at = next_structural(parser->index, at);
+    } else {
+        while (is_json_whitespace(source, at)) {
+            ++at;
+        }
     }
 
     if (is_in_bounds(source, at)) {
@@ -194,11 +193,25 @@ json_token get_json_token(json_parser* parser)
         case '"': {
             result.type = eJsonTokenType::StringLiteral;
             uint64_t string_start = at;
-            while (is_in_bounds(source, at) && (source.data[at] != '"')) {
-                if (is_in_bounds(source, at + 1) && (source.data[at] == '\\') && (source.data[at + 1] == '"')) {
+            if (parser->index) {
+                // NOTE: the closing quote is the very next index entry.
+                at = next_structural(parser->index, at);
+                result.value.data = source.data + string_start;
+                result.value.count = at - string_start;
+                if (is_in_bounds(source, at))
+                    ++at;
+                break;
+            }
+            for (;;) {
+                while (!(json_byte_classes.classes[source.data[at]] & JSON_STRING_STOP_CLASS)) {
                     ++at;
                 }
-                ++at;
+                if ((source.data[at] == '"') || (at >= source.count)) {
+                    break;
+                }
+                // NOTE: a backslash skips the byte after it, and a zero byte
+                // inside the string is just part of it.
+                at += ((source.data[at] == '\\') && is_in_bounds(source, at + 1)) ? 2 : 1;
             }
             result.value.data = source.data + string_start;
             result.value.count = at - string_start;
@@ -225,20 +238,15 @@ json_token get_json_token(json_parser* parser)
                     ++at;
                 }
             }
-            if (is_in_bounds(source, at) && (source.data[at] == '.')) {
+            if (source.data[at] == '.') {
                 ++at;
                 while (is_json_digit(source, at)) {
                     ++at;
                 }
             }
-            if (is_in_bounds(source, at)
-                && ((source.data[at] == 'e')
-                    || (source.data[at] == 'E'))) {
+            if ((source.data[at] | 0x20) == 'e') {
                 ++at;
-                if (is_in_bounds(source, at)
-                    && ((source.data[at] == '+')
-                        || (source.data[at] == '-'))) {
-
+                if ((source.data[at] == '+') || (source.data[at] == '-')) {
                     ++at;
                 }
                 while (is_json_digit(source, at)) {
@@ -250,6 +258,25 @@ json_token get_json_token(json_parser* parser)
         default:
             break;
         }
+
+        // NOTE: the structural index only records where a number or keyword
+        // starts, so trailing garbage glued to one has to be caught here.
+        if (parser->index && is_in_bounds(source, at)
+            && ((result.type == eJsonTokenType::Number) || (result.type == eJsonTokenType::True)
+                || (result.type == eJsonTokenType::False) || (result.type == eJsonTokenType::Null))) {
+            uint8_t next = source.data[at];
+            if (!json_char_class(next) && (next != '"')) {
+                result.type = eJsonTokenType::Error;
+            }
+        }
+    }
+
+    // NOTE: a keyword that does not fit is an Error without reaching the end.
+    if (parser->has_more_input
+        && ((at >= source.count)
+            || ((result.type == eJsonTokenType::Error) && (source.count - (result.value.data - source.data) < 5)))) {
+        result = {};
+        at = parser->at;
     }
     parser->at = at;
     return result;
@@ -276,7 +303,11 @@ json_element* parse_json_element(json_parser* parser, buffer label, json_token v
 
     json_element* result = nullptr;
     if (valid) {
-        result = (json_element*)malloc(sizeof(json_element));
+        result = push_struct(parser->nodes, json_element);
+        if (!result) {
+            error(parser, value, "out of json node memory");
+            return nullptr;
+        }
         result->label = label;
         result->value = value.value;
         result->first_sub_element = sub_element;
@@ -290,6 +321,7 @@ json_element* parse_json_list(json_parser* parser,
     eJsonTokenType end_type,
     bool has_labels)
 {
+    TIME_FUNCTION;
     json_element* first_element = {};
     json_element* last_element = {};
     while (is_parsing(parser)) {
@@ -326,23 +358,37 @@ json_element* parse_json_list(json_parser* parser,
     return first_element;
 }
 
-json_element* parse_json(buffer input_json)
+// NOTE: every element but the outermost needs at least one byte of its own
+// plus a separator, so an input of N bytes never holds more than N/2 + 1
+// elements. Reserving for that bound means the parse never has to grow.
+memory_arena make_json_arena(buffer input_json)
+{
+    uint64_t max_element_count = input_json.count / 2 + 1;
+    memory_arena result = make_arena(max_element_count * sizeof(json_element));
+    return result;
+}
+
+// NOTE: all elements are pushed onto `nodes`, which must outlive the result
+// and is released as a whole by free_json.
+json_element* parse_json(buffer input_json, memory_arena* nodes)
 {
+    TIME_BANDWIDTH(__func__, input_json.count);
+    json_structural_index index;
+    init_structural_index(&index, input_json);
+
     json_parser parser = {};
     parser.source = input_json;
+    parser.nodes = nodes;
+    parser.index = &index;
 
     json_element* result = parse_json_element(&parser, {}, get_json_token(&parser));
     return result;
 }
 
-void free_json(json_element* element)
+void free_json(memory_arena* nodes)
 {
-    while (element) {
-        json_element* free_element = element;
-        element = element->next_sibling;
-        free_json(free_element->first_sub_element);
-        free(free_element);
-    }
+    TIME_FUNCTION;
+    release_arena(nodes);
 }
 
 json_element* lookup_element(json_element* object, buffer element_name)
@@ -359,92 +405,245 @@ json_element* lookup_element(json_element* object, buffer element_name)
     return result;
 }
 
-double convert_json_sign(buffer source, uint64_t* at_result)
+// NOTE: every power of ten up to 1e22 is exactly representable as a double.
+constexpr double exact_powers_of_ten[] = {
+    1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+    1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+};
+
+// Slow but correctly rounded conversion for the few numbers the fast paths in
+// convert_number_to_double cannot settle. from_chars leaves the result alone
+// when it is out of range, so that case is resolved from `decimal_exponent`,
+// the power of ten of the leading digit: overflow to infinity, underflow to
+// zero.
+double convert_number_to_double_fallback(buffer source, bool negative, int64_t decimal_exponent)
 {
-    uint64_t at = *at_result;
-    double result = 1.0;
-    if (is_in_bounds(source, at) && (source.data[at] == '-')) {
-        result = -1.0;
-        ++at;
+    double result = 0.0;
+    std::from_chars_result status = std::from_chars((char const*)source.data, (char const*)source.data + source.count, result);
+    if (status.ec == std::errc::result_out_of_range) {
+        result = (decimal_exponent > 0) ? HUGE_VAL : 0.0;
+        result = negative ? -result : result;
     }
-    *at_result = at;
     return result;
 }
 
-double convert_json_number(buffer source, uint64_t* at_result)
+// Eisel-Lemire: rounds mantissa * 10^exponent to a double by multiplying the
+// mantissa, normalized to 64 bits, with a 128-bit approximation of 5^exponent
+// and taking the top bits of the product. Returns false in the rare case that
+// the truncated product cannot tell which way to round.
+// NOTE: after "Number Parsing at a Gigabyte per Second" (Lemire, 2021) and
+// its fast_float implementation. `mantissa` must not be zero.
+bool compute_double_eisel_lemire(uint64_t mantissa, int64_t exponent, bool negative, double* result)
 {
-    uint64_t at = *at_result;
-    double result = 0.0;
-    while (is_in_bounds(source, at)) {
-        uint8_t c = uint8_t(source.data[at]) - (uint8_t)'0';
-        if (c < 10) {
-            result = 10.0 * result + double(c);
-            ++at;
+    constexpr int32_t MANTISSA_BITS = 52;
+    constexpr int32_t INFINITE_POWER = 0x7FF;
+    uint64_t bits = 0;
+    if (exponent < JSON_MIN_POWER_OF_TEN) {
+        bits = 0;
+    } else if (exponent > JSON_MAX_POWER_OF_TEN) {
+        bits = (uint64_t)INFINITE_POWER << MANTISSA_BITS;
+    } else {
+        int32_t leading_zeros = std::countl_zero(mantissa);
+        uint64_t w = mantissa << leading_zeros;
+        uint64_t const* power = json_powers_of_five + 2 * (exponent - JSON_MIN_POWER_OF_TEN);
+
+        // NOTE: 55 bits of the product are needed (the mantissa, its implicit
+        // bit, a rounding bit and the bit the product may carry into). Only
+        // if all the bits below those are ones could the low half of the
+        // power change them, and only then is it multiplied in.
+        unsigned __int128 product = (unsigned __int128)w * power[0];
+        uint64_t high = (uint64_t)(product >> 64);
+        uint64_t low = (uint64_t)product;
+        constexpr uint64_t PRECISION_MASK = ~0ull >> (MANTISSA_BITS + 3);
+        if ((high & PRECISION_MASK) == PRECISION_MASK) {
+            uint64_t second_high = (uint64_t)(((unsigned __int128)w * power[1]) >> 64);
+            low += second_high;
+            high += (second_high > low);
+            if (((high & PRECISION_MASK) == PRECISION_MASK) && (low == ~0ull)) {
+                return false;
+            }
+        }
+
+        int32_t upper_bit = (int32_t)(high >> 63);
+        int32_t shift = upper_bit + 64 - MANTISSA_BITS - 3;
+        uint64_t fraction = high >> shift;
+        // NOTE: floor(log2(10^exponent)) + 63, plus the 1023 bias.
+        int32_t power2 = (int32_t)((((152170 + 65536) * exponent) >> 16) + 63) + upper_bit - leading_zeros + 1023;
+        if (power2 <= 0) {
+            // NOTE: subnormal, or zero when it is shifted out entirely.
+            if (-power2 + 1 >= 64) {
+                fraction = 0;
+            } else {
+                fraction >>= -power2 + 1;
+                fraction += fraction & 1;
+                fraction >>= 1;
+            }
+            power2 = (fraction < (1ull << MANTISSA_BITS)) ? 0 : 1;
         } else {
-            break;
+            // NOTE: an exact halfway product rounds to even, not up. It can
+            // only be exact for these exponents.
+            if ((low <= 1) && (exponent >= -4) && (exponent <= 23) && ((fraction & 3) == 1) && ((fraction << shift) == high)) {
+                fraction &= ~1ull;
+            }
+            fraction += fraction & 1;
+            fraction >>= 1;
+            if (fraction >= (2ull << MANTISSA_BITS)) {
+                fraction = 1ull << MANTISSA_BITS;
+                ++power2;
+            }
+            fraction &= ~(1ull << MANTISSA_BITS);
+            if (power2 >= INFINITE_POWER) {
+                power2 = INFINITE_POWER;
+                fraction = 0;
+            }
         }
+        bits = fraction | ((uint64_t)power2 << MANTISSA_BITS);
     }
-    *at_result = at;
-    return result;
+    bits |= (uint64_t)negative << 63;
+    memcpy(result, &bits, sizeof(bits));
+    return true;
 }
 
-double convert_element_to_double(json_element* object, buffer element_name)
+// Converts JSON number text to the nearest double. The first 19 significant
+// digits are gathered into one 64-bit integer. When that integer and the
+// power of ten both fit exactly in a double, a single multiply or divide
+// rounds the result once (Clinger's fast path). Anything else, such as the
+// 17-digit coordinates the generator writes, goes through Eisel-Lemire. If
+// digits past the 19th were dropped, the value lies between the gathered
+// integer and the next one, and the result is only taken when both round to
+// the same double. The remaining cases fall back to from_chars.
+// NOTE: like the tokenizer it reads the byte just past `source` instead of
+// checking the bounds. For the text of a Number token that byte is either
+// padding or whatever ended the token, which continues no number.
+double convert_number_to_double(buffer source)
 {
-    double result = 0.0;
-    json_element* element = lookup_element(object, element_name);
-    if (element) {
-        buffer source = element->value;
-        uint64_t at = 0;
-
-        double sign = convert_json_sign(source, &at);
-        double number = convert_json_number(source, &at);
-        if (is_in_bounds(source, at) && (source.data[at] == '.')) {
-            ++at;
-            double C = 1.0 / 10.0;
-            while (is_in_bounds(source, at)) {
-                uint8_t Char = source.data[at] - (uint8_t)'0';
-                if (Char < 10) {
-                    number = number + C * (double)Char;
-                    C *= 1.0 / 10.0;
-                    ++at;
-                } else {
-                    break;
-                }
+    if (!source.count) {
+        return 0.0;
+    }
+    uint64_t at = 0;
+    bool negative = (source.data[at] == '-');
+    at += negative;
+
+    // NOTE: integer and fraction digits go through one loop; the decimal point
+    // only shifts where the exponent starts counting. That saves a loop exit
+    // (and its branch miss) per number.
+    uint64_t mantissa = 0;
+    uint32_t significant_digits = 0;
+    int64_t exponent = 0;
+    int64_t fraction_start = -1;
+    bool exact = true;
+    while (json_byte_classes.classes[source.data[at]] & JSON_NUMBER_CLASS) {
+        uint8_t digit = source.data[at] - (uint8_t)'0';
+        if (digit < 10) {
+            if (significant_digits < 19) {
+                mantissa = 10 * mantissa + digit;
+                significant_digits += (mantissa != 0);
+            } else {
+                ++exponent;
+                exact &= (digit == 0);
             }
+        } else if ((source.data[at] == '.') && (fraction_start < 0)) {
+            fraction_start = (int64_t)at + 1;
+        } else {
+            break;
         }
-        if (is_in_bounds(source, at) && ((source.data[at] == 'e') || (source.data[at] == 'E'))) {
+        ++at;
+    }
+    if (fraction_start >= 0) {
+        // NOTE: digits dropped past the 19th already bumped the exponent, so
+        // only the fraction digits that were kept move it back down.
+        int64_t fraction_digits = (int64_t)at - fraction_start;
+        exponent -= fraction_digits;
+    }
+
+    if ((source.data[at] | 0x20) == 'e') {
+        ++at;
+        bool exponent_negative = false;
+        if ((source.data[at] == '+') || (source.data[at] == '-')) {
+            exponent_negative = (source.data[at] == '-');
             ++at;
-            if (is_in_bounds(source, at) && source.data[at] == '+') {
-                ++at;
+        }
+        int64_t explicit_exponent = 0;
+        while (is_json_digit(source, at)) {
+            uint8_t digit = source.data[at] - (uint8_t)'0';
+            if (explicit_exponent < 100000) {
+                explicit_exponent = 10 * explicit_exponent + digit;
+            }
+            ++at;
+        }
+        exponent += exponent_negative ? -explicit_exponent : explicit_exponent;
+    }
+
+    double result = 0.0;
+    constexpr uint64_t MAX_EXACT_MANTISSA = 1ull << 53;
+    if (exact && (mantissa <= MAX_EXACT_MANTISSA) && (exponent >= -22) && (exponent <= 22)) {
+        result = (double)mantissa;
+        if (exponent < 0) {
+            result /= exact_powers_of_ten[-exponent];
+        } else {
+            result *= exact_powers_of_ten[exponent];
+        }
+        result = negative ? -result : result;
+    } else if (mantissa == 0) {
+        result = negative ? -0.0 : 0.0;
+    } else {
+        bool is_done = compute_double_eisel_lemire(mantissa, exponent, negative, &result);
+        if (is_done && !exact) {
+            double upper = 0.0;
+            is_done = compute_double_eisel_lemire(mantissa + 1, exponent, negative, &upper) && (upper == result);
+        }
+        if (!is_done) {
+            result = convert_number_to_double_fallback(source, negative, exponent + significant_digits - 1);
+        }
+    }
+    return result;
+}
+
+// Reads the fields of a json_schema record out of `object` in one pass over
+// its members, instead of one lookup_element per field. As with
+// lookup_element, the first of two members with the same key wins and a
+// field with no member stays zero.
+template <typename Record>
+Record read_json_record(json_element* object)
+{
+    TIME_FUNCTION;
+    static_assert(SCHEMA_FIELD_COUNT<Record> <= 32, "fields seen are tracked in a 32-bit mask");
+    Record result = {};
+    if (object) {
+        json_record_matcher<Record> matcher = {};
+        uint32_t seen = 0;
+        for (json_element* member = object->first_sub_element; member; member = member->next_sibling) {
+            uint32_t field_index = match_schema_key(&matcher, member->label);
+            if ((field_index < SCHEMA_FIELD_COUNT<Record>) && !(seen & (1u << field_index))) {
+                seen |= 1u << field_index;
+                result.*get_schema_member<Record>(field_index) = convert_number_to_double(member->value);
             }
-            double exponent_sign = convert_json_sign(source, &at);
-            double exponent = exponent_sign * convert_json_number(source, &at);
-            number *= std::pow(10.0, exponent);
         }
-        result = sign * number;
     }
     return result;
 }
-uint64_t parse_haversine_pairs(buffer input_json, uint64_t max_pair_count, haversine_pair* pairs)
+
+// NOTE: the pairs go to any output with a push_pair overload (see common.h),
+// so the same walk fills either the AoS array or the SoA columns.
+template <typename Sink>
+void parse_haversine_pairs(buffer input_json, Sink* output)
 {
-    uint64_t pair_count = 0;
-    json_element* json = parse_json(input_json);
+    TIME_FUNCTION;
+    memory_arena nodes = make_json_arena(input_json);
+    json_element* json = parse_json(input_json, &nodes);
     json_element* pairs_array = lookup_element(json, CONSTANT_STRING("pairs"));
     if (pairs_array) {
-        for (json_element* element = pairs_array->first_sub_element; element && pair_count < max_pair_count; element = element->next_sibling) {
-            haversine_pair* pair = pairs + pair_count++;
-            //            std::cout << std::setw(10) << std::fixed;
-            pair->x0 = convert_element_to_double(element, CONSTANT_STRING("x0"));
-            //            std::cout << "x0: " << pair->x0 << ", ";
-            pair->y0 = convert_element_to_double(element, CONSTANT_STRING("y0"));
-            //            std::cout << "y0: " << pair->y0 << ", ";
-            pair->x1 = convert_element_to_double(element, CONSTANT_STRING("x1"));
-            //            std::cout << "x1: " << pair->x1 << ", ";
-            pair->y1 = convert_element_to_double(element, CONSTANT_STRING("y1"));
-            //            std::cout << "y1: " << pair->y1 << std::endl;
+        for (json_element* element = pairs_array->first_sub_element; element; element = element->next_sibling) {
+            push_pair(output, read_json_record<haversine_pair>(element));
         }
     }
-    free_json(json);
-    return pair_count;
+    free_json(&nodes);
+}
+
+uint64_t parse_haversine_pairs(buffer input_json, uint64_t max_pair_count, haversine_pair* pairs)
+{
+    haversine_pair_array output = { pairs, max_pair_count, 0 };
+    parse_haversine_pairs(input_json, &output);
+    return output.count;
 }
 } // namespace json
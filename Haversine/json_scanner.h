@@ -0,0 +1,318 @@
+#pragma once
+#include "buffer.h"
+#include "cpu_features.h"
+#include <cstdint>
+#include <cstring>
+#include <immintrin.h>
+
+namespace json {
+
+// Stage 1 of the tokenizer: classify the input 64 bytes at a time into
+// bitmasks and turn them into a list of positions where a token starts or a
+// string ends (structural characters, both quotes of every string and the
+// first byte of every number/keyword). get_json_token then jumps from
+// position to position instead of stepping over whitespace and string bodies
+// one byte at a time.
+struct json_block_masks {
+    uint64_t operators;
+    uint64_t brackets;
+    uint64_t whitespace;
+    uint64_t quotes;
+    uint64_t backslashes;
+};
+
+typedef json_block_masks (*json_classify_block_fn)(uint8_t const* block);
+
+// NOTE: character classes come from two 16-entry tables indexed by the high
+// and low nibble; a byte belongs to a class when both lookups share a bit.
+// This is the same lookup for the scalar path and for PSHUFB.
+//   bit0: ','          bit1: ':' ';'       bit2: '[' ']' '{' '}'
+//   bit3: ' '          bit4: '\t' '\n' '\r'
+constexpr uint8_t JSON_OPERATOR_CLASS = 0x07;
+constexpr uint8_t JSON_BRACKET_CLASS = 0x04;
+constexpr uint8_t JSON_WHITESPACE_CLASS = 0x18;
+
+alignas(16) constexpr uint8_t json_high_nibble_classes[16] = {
+    0x10, 0, 0x09, 0x02, 0, 0x04, 0, 0x04, 0, 0, 0, 0, 0, 0, 0, 0
+};
+alignas(16) constexpr uint8_t json_low_nibble_classes[16] = {
+    0x08, 0, 0, 0, 0, 0, 0, 0, 0, 0x10, 0x12, 0x06, 0x01, 0x14, 0, 0
+};
+
+uint8_t json_char_class(uint8_t c)
+{
+    return json_high_nibble_classes[c >> 4] & json_low_nibble_classes[c & 0xF];
+}
+
+json_block_masks classify_json_block_scalar(uint8_t const* block)
+{
+    json_block_masks result = {};
+    for (uint32_t i = 0; i < 64; ++i) {
+        uint8_t c = block[i];
+        uint8_t char_class = json_char_class(c);
+        uint64_t bit = 1ull << i;
+        result.operators |= (char_class & JSON_OPERATOR_CLASS) ? bit : 0;
+        result.brackets |= (char_class & JSON_BRACKET_CLASS) ? bit : 0;
+        result.whitespace |= (char_class & JSON_WHITESPACE_CLASS) ? bit : 0;
+        result.quotes |= (c == '"') ? bit : 0;
+        result.backslashes |= (c == '\\') ? bit : 0;
+    }
+    return result;
+}
+
+__attribute__((target("sse4.2"))) json_block_masks classify_json_block_sse42(uint8_t const* block)
+{
+    __m128i high_table = _mm_load_si128((__m128i const*)json_high_nibble_classes);
+    __m128i low_table = _mm_load_si128((__m128i const*)json_low_nibble_classes);
+    __m128i nibble_mask = _mm_set1_epi8(0x0F);
+    __m128i operator_class = _mm_set1_epi8(JSON_OPERATOR_CLASS);
+    __m128i bracket_class = _mm_set1_epi8(JSON_BRACKET_CLASS);
+    __m128i whitespace_class = _mm_set1_epi8(JSON_WHITESPACE_CLASS);
+    __m128i zero = _mm_setzero_si128();
+
+    json_block_masks result = {};
+    for (uint32_t i = 0; i < 4; ++i) {
+        __m128i bytes = _mm_loadu_si128((__m128i const*)(block + 16 * i));
+        __m128i high = _mm_and_si128(_mm_srli_epi16(bytes, 4), nibble_mask);
+        __m128i low = _mm_and_si128(bytes, nibble_mask);
+        __m128i classes = _mm_and_si128(_mm_shuffle_epi8(high_table, high), _mm_shuffle_epi8(low_table, low));
+
+        __m128i is_operator = _mm_cmpeq_epi8(_mm_and_si128(classes, operator_class), zero);
+        __m128i is_bracket = _mm_cmpeq_epi8(_mm_and_si128(classes, bracket_class), zero);
+        __m128i is_whitespace = _mm_cmpeq_epi8(_mm_and_si128(classes, whitespace_class), zero);
+        __m128i is_quote = _mm_cmpeq_epi8(bytes, _mm_set1_epi8('"'));
+        __m128i is_backslash = _mm_cmpeq_epi8(bytes, _mm_set1_epi8('\\'));
+
+        uint32_t shift = 16 * i;
+        result.operators |= (uint64_t)(uint16_t)~_mm_movemask_epi8(is_operator) << shift;
+        result.brackets |= (uint64_t)(uint16_t)~_mm_movemask_epi8(is_bracket) << shift;
+        result.whitespace |= (uint64_t)(uint16_t)~_mm_movemask_epi8(is_whitespace) << shift;
+        result.quotes |= (uint64_t)(uint16_t)_mm_movemask_epi8(is_quote) << shift;
+        result.backslashes |= (uint64_t)(uint16_t)_mm_movemask_epi8(is_backslash) << shift;
+    }
+    return result;
+}
+
+__attribute__((target("avx2"))) json_block_masks classify_json_block_avx2(uint8_t const* block)
+{
+    __m256i high_table = _mm256_broadcastsi128_si256(_mm_load_si128((__m128i const*)json_high_nibble_classes));
+    __m256i low_table = _mm256_broadcastsi128_si256(_mm_load_si128((__m128i const*)json_low_nibble_classes));
+    __m256i nibble_mask = _mm256_set1_epi8(0x0F);
+    __m256i operator_class = _mm256_set1_epi8(JSON_OPERATOR_CLASS);
+    __m256i bracket_class = _mm256_set1_epi8(JSON_BRACKET_CLASS);
+    __m256i whitespace_class = _mm256_set1_epi8(JSON_WHITESPACE_CLASS);
+    __m256i zero = _mm256_setzero_si256();
+
+    json_block_masks result = {};
+    for (uint32_t i = 0; i < 2; ++i) {
+        __m256i bytes = _mm256_loadu_si256((__m256i const*)(block + 32 * i));
+        __m256i high = _mm256_and_si256(_mm256_srli_epi16(bytes, 4), nibble_mask);
+        __m256i low = _mm256_and_si256(bytes, nibble_mask);
+        __m256i classes = _mm256_and_si256(_mm256_shuffle_epi8(high_table, high), _mm256_shuffle_epi8(low_table, low));
+
+        __m256i is_operator = _mm256_cmpeq_epi8(_mm256_and_si256(classes, operator_class), zero);
+        __m256i is_bracket = _mm256_cmpeq_epi8(_mm256_and_si256(classes, bracket_class), zero);
+        __m256i is_whitespace = _mm256_cmpeq_epi8(_mm256_and_si256(classes, whitespace_class), zero);
+        __m256i is_quote = _mm256_cmpeq_epi8(bytes, _mm256_set1_epi8('"'));
+        __m256i is_backslash = _mm256_cmpeq_epi8(bytes, _mm256_set1_epi8('\\'));
+
+        uint32_t shift = 32 * i;
+        result.operators |= (uint64_t)(uint32_t)~_mm256_movemask_epi8(is_operator) << shift;
+        result.brackets |= (uint64_t)(uint32_t)~_mm256_movemask_epi8(is_bracket) << shift;
+        result.whitespace |= (uint64_t)(uint32_t)~_mm256_movemask_epi8(is_whitespace) << shift;
+        result.quotes |= (uint64_t)(uint32_t)_mm256_movemask_epi8(is_quote) << shift;
+        result.backslashes |= (uint64_t)(uint32_t)_mm256_movemask_epi8(is_backslash) << shift;
+    }
+    return result;
+}
+
+// NOTE: a whole block in one register, and the compares produce the bitmasks
+// directly instead of through movemask.
+__attribute__((target("avx512bw"))) json_block_masks classify_json_block_avx512(uint8_t const* block)
+{
+    // NOTE: the zero-masking broadcast, since GCC warns about the plain one.
+    __m512i high_table = _mm512_maskz_broadcast_i32x4((__mmask16)~0, _mm_load_si128((__m128i const*)json_high_nibble_classes));
+    __m512i low_table = _mm512_maskz_broadcast_i32x4((__mmask16)~0, _mm_load_si128((__m128i const*)json_low_nibble_classes));
+    __m512i nibble_mask = _mm512_set1_epi8(0x0F);
+
+    __m512i bytes = _mm512_loadu_si512(block);
+    __m512i high = _mm512_and_si512(_mm512_srli_epi16(bytes, 4), nibble_mask);
+    __m512i low = _mm512_and_si512(bytes, nibble_mask);
+    __m512i classes = _mm512_and_si512(_mm512_shuffle_epi8(high_table, high), _mm512_shuffle_epi8(low_table, low));
+
+    json_block_masks result = {};
+    result.operators = _mm512_test_epi8_mask(classes, _mm512_set1_epi8(JSON_OPERATOR_CLASS));
+    result.brackets = _mm512_test_epi8_mask(classes, _mm512_set1_epi8(JSON_BRACKET_CLASS));
+    result.whitespace = _mm512_test_epi8_mask(classes, _mm512_set1_epi8(JSON_WHITESPACE_CLASS));
+    result.quotes = _mm512_cmpeq_epi8_mask(bytes, _mm512_set1_epi8('"'));
+    result.backslashes = _mm512_cmpeq_epi8_mask(bytes, _mm512_set1_epi8('\\'));
+    return result;
+}
+
+json_classify_block_fn select_json_classify_block(lsp::eIsaLevel level)
+{
+    json_classify_block_fn result = classify_json_block_scalar;
+    if (level >= lsp::eIsaLevel::Avx512) {
+        result = classify_json_block_avx512;
+    } else if (level >= lsp::eIsaLevel::Avx2) {
+        result = classify_json_block_avx2;
+    } else if (level >= lsp::eIsaLevel::Sse42) {
+        result = classify_json_block_sse42;
+    }
+    return result;
+}
+
+static json_classify_block_fn global_json_classify_block = select_json_classify_block(lsp::get_best_isa_level());
+
+// NOTE: the index is produced one 64-byte block ahead of the tokenizer, as a
+// bitmask of token positions, so it costs no memory traffic and stays in
+// registers no matter how large the input is. The string, escape and scalar
+// state of the last scanned block carries over to the next one.
+struct json_structural_index {
+    buffer source;
+    uint64_t block_start;
+    uint64_t structurals;
+
+    uint64_t in_string;
+    uint64_t escape_pending;
+    uint64_t previous_scalar;
+};
+
+// NOTE: `start` must be outside any string and not right after a backslash;
+// the index only reports positions from there on.
+void init_structural_index(json_structural_index* index, buffer source, uint64_t start = 0)
+{
+    *index = {};
+    index->source = source;
+    // NOTE: no block has been scanned yet; the first scan starts at `start`.
+    index->block_start = start - 64;
+}
+
+uint64_t prefix_xor(uint64_t bits)
+{
+    bits ^= bits << 1;
+    bits ^= bits << 2;
+    bits ^= bits << 4;
+    bits ^= bits << 8;
+    bits ^= bits << 16;
+    bits ^= bits << 32;
+    return bits;
+}
+
+// NOTE: escapes are rare in our inputs, so the characters escaped by a run of
+// backslashes are resolved serially, and only for blocks that contain one.
+uint64_t find_escaped_characters(uint64_t backslashes, uint64_t* escape_pending)
+{
+    uint64_t escaped = 0;
+    if (backslashes | *escape_pending) {
+        bool pending = *escape_pending;
+        for (uint32_t i = 0; i < 64; ++i) {
+            uint64_t bit = 1ull << i;
+            if (pending) {
+                escaped |= bit;
+                pending = false;
+            } else if (backslashes & bit) {
+                pending = true;
+            }
+        }
+        *escape_pending = pending;
+    }
+    return escaped;
+}
+
+void scan_next_block(json_structural_index* index)
+{
+    buffer source = index->source;
+    uint64_t block_start = index->block_start + 64;
+    uint8_t const* block = source.data + block_start;
+
+    // NOTE: the tail is padded with whitespace, which never starts a token.
+    alignas(64) uint8_t tail[64];
+    if (source.count - block_start < 64) {
+        uint64_t remaining = source.count - block_start;
+        memset(tail, ' ', sizeof(tail));
+        memcpy(tail, block, remaining);
+        block = tail;
+    }
+
+    json_block_masks masks = global_json_classify_block(block);
+
+    uint64_t escaped = find_escaped_characters(masks.backslashes, &index->escape_pending);
+    uint64_t quotes = masks.quotes & ~escaped;
+
+    // NOTE: in_string covers each opening quote and the string body but not
+    // the closing quote.
+    uint64_t in_string = prefix_xor(quotes) ^ index->in_string;
+    index->in_string = (uint64_t)((int64_t)in_string >> 63);
+
+    uint64_t operators = masks.operators & ~in_string;
+    uint64_t scalars = ~(masks.operators | masks.whitespace | quotes) & ~in_string;
+    uint64_t scalar_starts = scalars & ~((scalars << 1) | index->previous_scalar);
+    index->previous_scalar = scalars >> 63;
+
+    index->structurals = operators | scalar_starts | quotes;
+    index->block_start = block_start;
+}
+
+// Calls visit(position, c, in_string) for each bracket character c in
+// [begin, end), in order, until visit returns false. in_string tells whether
+// the bracket is inside a string assuming `begin` is outside one; the string
+// state at `begin` may be unknown, since the other case is its complement.
+// Returns whether the walked bytes hold an odd number of unescaped quotes.
+template <typename Visitor>
+bool walk_json_brackets(buffer source, uint64_t begin, uint64_t end, Visitor visit)
+{
+    // NOTE: a backslash is only valid inside a string, so an odd run of them
+    // right before `begin` means its first character is escaped.
+    uint64_t escape_pending = 0;
+    for (uint64_t at = begin; (at > 0) && (source.data[at - 1] == '\\'); --at) {
+        escape_pending ^= 1;
+    }
+
+    uint64_t in_string = 0;
+    for (uint64_t block_start = begin; block_start < end; block_start += 64) {
+        uint8_t const* block = source.data + block_start;
+        alignas(64) uint8_t tail[64];
+        if (end - block_start < 64) {
+            memset(tail, ' ', sizeof(tail));
+            memcpy(tail, block, end - block_start);
+            block = tail;
+        }
+
+        json_block_masks masks = global_json_classify_block(block);
+        uint64_t escaped = find_escaped_characters(masks.backslashes, &escape_pending);
+        uint64_t string_mask = prefix_xor(masks.quotes & ~escaped) ^ in_string;
+        in_string = (uint64_t)((int64_t)string_mask >> 63);
+
+        for (uint64_t brackets = masks.brackets; brackets; brackets &= brackets - 1) {
+            uint32_t bit = __builtin_ctzll(brackets);
+            if (!visit(block_start + bit, block[bit], (bool)((string_mask >> bit) & 1))) {
+                return in_string & 1;
+            }
+        }
+    }
+    return in_string & 1;
+}
+
+// Returns the position of the next token start (or closing quote) at or
+// after `at`, or source.count when there is none.
+uint64_t next_structural(json_structural_index* index, uint64_t at)
+{
+    for (;;) {
+        while (index->structurals) {
+            uint64_t position = index->block_start + __builtin_ctzll(index->structurals);
+            index->structurals &= index->structurals - 1;
+            if (position >= at) {
+                return position;
+            }
+        }
+
+        if (index->block_start + 64 >= index->source.count) {
+            break;
+        }
+        scan_next_block(index);
+    }
+    return index->source.count;
+}
+
+} // namespace json
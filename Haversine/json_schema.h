@@ -0,0 +1,105 @@
+#pragma once
+#include "buffer.h"
+#include "common.h"
+#include <bit>
+#include <cstdint>
+#include <cstring>
+#include <iterator>
+#include <utility>
+
+namespace json {
+
+// Compile-time description of a flat record read out of a JSON object: each
+// field is a key and the double member its number goes to. From it the
+// readers below match keys without a string search. Each key is packed at
+// compile time into one integer, so checking a key is one 2-8 byte load and
+// compare of constant size. The field expected next is tried first, so for
+// input that always lists the fields in schema order (everything our
+// generator writes) every key costs a single compare; a key out of order or
+// unknown falls back to trying every field.
+static_assert(std::endian::native == std::endian::little, "schema keys are packed little-endian");
+
+template <typename Record>
+struct json_schema_field {
+    uint64_t key;
+    uint32_t key_length;
+    double Record::*member;
+};
+
+template <typename Record, size_t N>
+constexpr json_schema_field<Record> schema_field(char const (&name)[N], double Record::*member)
+{
+    static_assert((N - 1) <= sizeof(uint64_t), "schema keys must fit in one 64-bit compare");
+    json_schema_field<Record> result = {};
+    for (size_t i = 0; i < N - 1; ++i) {
+        result.key |= (uint64_t)(uint8_t)name[i] << (8 * i);
+    }
+    result.key_length = N - 1;
+    result.member = member;
+    return result;
+}
+
+// NOTE: specialized for each record type that is read with a schema.
+template <typename Record>
+struct json_schema;
+
+template <>
+struct json_schema<haversine_pair> {
+    static constexpr json_schema_field<haversine_pair> fields[] = {
+        schema_field("x0", &haversine_pair::x0),
+        schema_field("y0", &haversine_pair::y0),
+        schema_field("x1", &haversine_pair::x1),
+        schema_field("y1", &haversine_pair::y1),
+    };
+};
+
+template <typename Record>
+constexpr uint32_t SCHEMA_FIELD_COUNT = (uint32_t)std::size(json_schema<Record>::fields);
+
+template <uint32_t Length>
+uint64_t load_key_word(uint8_t const* data)
+{
+    uint64_t result = 0;
+    memcpy(&result, data, Length);
+    return result;
+}
+
+template <typename Record, uint32_t Index>
+bool is_schema_key(buffer key)
+{
+    constexpr json_schema_field<Record> field = json_schema<Record>::fields[Index];
+    return (key.count == field.key_length) && (load_key_word<field.key_length>(key.data) == field.key);
+}
+
+// The reading state for one record: which field is expected next.
+template <typename Record>
+struct json_record_matcher {
+    uint32_t expected;
+};
+
+// Returns the index of the field `key` names, or SCHEMA_FIELD_COUNT<Record>
+// when it is not in the schema.
+template <typename Record>
+uint32_t match_schema_key(json_record_matcher<Record>* matcher, buffer key)
+{
+    constexpr uint32_t count = SCHEMA_FIELD_COUNT<Record>;
+    uint32_t result = count;
+    [&]<uint32_t... Index>(std::integer_sequence<uint32_t, Index...>) {
+        ((((matcher->expected == Index) && is_schema_key<Record, Index>(key)) && ((result = Index), true)) || ...);
+        if (result == count) {
+            ((is_schema_key<Record, Index>(key) && ((result = Index), true)) || ...);
+        }
+    }(std::make_integer_sequence<uint32_t, count>());
+    if (result < count) {
+        matcher->expected = (result + 1 < count) ? (result + 1) : 0;
+    }
+    return result;
+}
+
+template <typename Record>
+double Record::*get_schema_member(uint32_t field_index)
+{
+    return json_schema<Record>::fields[field_index].member;
+}
+
+} // namespace json
@@ -0,0 +1,86 @@
+#pragma once
+#include "file_stream.h"
+#include "json_events.h"
+
+namespace json {
+
+// Streaming version of parse_json_events: the input comes from a file_stream
+// one chunk at a time while the next chunks are still being read, so the
+// whole file is never held in memory. Each chunk is parsed as far as the last
+// token that is certainly complete; the tokenizer then suspends, the unread
+// tail is moved in front of the next chunk, and the same event parser carries
+// on from there, so a handler sees exactly the events it would have seen on
+// the whole buffer.
+template <typename Handler>
+bool parse_json_events_stream(lsp::file_stream* stream, Handler* handler)
+{
+    json_structural_index index;
+    json_event_parser parser = {};
+    parser.tokens.index = &index;
+    parser.tokens.has_more_input = true;
+    parser.state = eJsonEventState::Value;
+
+    bool result = false;
+    bool has_previous = false;
+    lsp::stream_chunk previous = {};
+    lsp::stream_chunk chunk = {};
+    buffer tail = {};
+    buffer spill = {};
+    while (parser.tokens.has_more_input && lsp::wait_for_chunk(stream, &chunk)) {
+        buffer window = {};
+        if (tail.count <= lsp::STREAM_CARRY_SIZE) {
+            window.data = chunk.data - tail.count;
+            window.count = tail.count + chunk.count;
+            if (tail.count) {
+                memcpy(window.data, tail.data, tail.count);
+            }
+        } else {
+            // NOTE: only a single string longer than the carry area gets here.
+            buffer joined = allocate_buffer(tail.count + chunk.count);
+            if (joined.data) {
+                memcpy(joined.data, tail.data, tail.count);
+                memcpy(joined.data + tail.count, chunk.data, chunk.count);
+            }
+            free_buffer(&spill);
+            spill = joined;
+            window = joined;
+        }
+        if (has_previous) {
+            lsp::release_chunk(stream, &previous);
+        }
+        previous = chunk;
+        has_previous = true;
+        if (!window.data && (tail.count + chunk.count)) {
+            break;
+        }
+
+        init_structural_index(&index, window);
+        parser.tokens.source = window;
+        parser.tokens.at = 0;
+        parser.tokens.has_more_input = !chunk.is_last;
+        result = parse_json_events(&parser, handler);
+
+        tail.data = window.data + parser.tokens.at;
+        tail.count = window.count - parser.tokens.at;
+        if ((parser.state == eJsonEventState::Done) || parser.tokens.had_error || handler->is_done()) {
+            break;
+        }
+    }
+    if (has_previous) {
+        lsp::release_chunk(stream, &previous);
+    }
+    free_buffer(&spill);
+    return result;
+}
+
+// NOTE: same result as parse_haversine_pairs_events on the whole file.
+template <typename Sink>
+void stream_haversine_pairs(lsp::file_stream* stream, Sink* output)
+{
+    TIME_BANDWIDTH(__func__, stream->file_size);
+    haversine_pair_extractor<Sink> extractor = {};
+    extractor.output = output;
+    parse_json_events_stream(stream, &extractor);
+}
+
+} // namespace json
@@ -0,0 +1,336 @@
+#pragma once
+#include "arena.h"
+#include "json_parser.h"
+
+namespace json {
+
+// Flat DOM: the whole document as one contiguous tape of tagged 64-bit words
+// in document order, instead of json_element nodes linked by pointers. The
+// top 8 bits of a word are its tag and the low 56 bits its payload:
+//   - a key or scalar: the offset of its text in the source, which stays
+//     there (strings without their quotes, numbers unconverted, as in
+//     json_element), followed by a second, untagged word with its length;
+//   - an object or array start: the index just past its end word, so
+//     skipping a whole subtree is a single jump;
+//   - an object or array end: the index of its start.
+// An object member is its key followed by its value. Walking children and
+// siblings is therefore index arithmetic over memory that is read front to
+// back, rather than a pointer chase over cold nodes.
+enum class eJsonTapeTag : uint8_t {
+    None = 0,
+    Key = 'k',
+    String = 's',
+    Number = 'n',
+    True = 't',
+    False = 'f',
+    Null = '0',
+    ObjectStart = '{',
+    ObjectEnd = '}',
+    ArrayStart = '[',
+    ArrayEnd = ']'
+};
+
+constexpr uint64_t JSON_TAPE_PAYLOAD_MASK = (1ull << 56) - 1;
+constexpr uint64_t JSON_TAPE_NONE = ~0ull;
+
+struct json_tape {
+    buffer source;
+    uint64_t* words;
+    uint64_t count;
+    memory_arena memory;
+};
+
+// NOTE: a position on a tape; `index` is JSON_TAPE_NONE when nothing was found.
+struct json_tape_element {
+    json_tape const* tape;
+    uint64_t index;
+};
+
+eJsonTapeTag get_tag(uint64_t word)
+{
+    return (eJsonTapeTag)(word >> 56);
+}
+
+uint64_t get_payload(uint64_t word)
+{
+    return word & JSON_TAPE_PAYLOAD_MASK;
+}
+
+bool is_container_start(eJsonTapeTag tag)
+{
+    return (tag == eJsonTapeTag::ObjectStart) || (tag == eJsonTapeTag::ArrayStart);
+}
+
+bool is_container_end(eJsonTapeTag tag)
+{
+    return (tag == eJsonTapeTag::ObjectEnd) || (tag == eJsonTapeTag::ArrayEnd);
+}
+
+bool is_scalar(eJsonTapeTag tag)
+{
+    return !is_container_start(tag) && !is_container_end(tag);
+}
+
+// NOTE: a key or scalar takes two words, its offset and its length.
+uint64_t get_entry_size(eJsonTapeTag tag)
+{
+    return is_scalar(tag) ? 2 : 1;
+}
+
+uint64_t push_tape_word(json_parser* parser, json_tape* tape, json_token token, uint64_t word)
+{
+    uint64_t* slot = push_struct(&tape->memory, uint64_t);
+    if (!slot) {
+        error(parser, token, "out of json tape memory");
+        return JSON_TAPE_NONE;
+    }
+    *slot = word;
+    return tape->count++;
+}
+
+uint64_t push_tape_entry(json_parser* parser, json_tape* tape, eJsonTapeTag tag, json_token token, uint64_t payload)
+{
+    return push_tape_word(parser, tape, token, ((uint64_t)tag << 56) | payload);
+}
+
+bool push_tape_scalar(json_parser* parser, json_tape* tape, eJsonTapeTag tag, json_token token)
+{
+    uint64_t offset = (uint64_t)(token.value.data - tape->source.data);
+    return (push_tape_entry(parser, tape, tag, token, offset) != JSON_TAPE_NONE)
+        && (push_tape_word(parser, tape, token, token.value.count) != JSON_TAPE_NONE);
+}
+
+void parse_json_tape_list(json_parser* parser, json_tape* tape, eJsonTokenType end_type, bool has_labels);
+
+bool parse_json_tape_value(json_parser* parser, json_tape* tape, json_token value)
+{
+    bool result = true;
+    switch (value.type) {
+    case eJsonTokenType::OpenBrace:
+    case eJsonTokenType::OpenBracket: {
+        // NOTE: the end word is pushed even after an error, so a tape cut
+        // short by bad input is still well formed up to where it stopped,
+        // the way parse_json still returns the elements it got to.
+        bool is_object = (value.type == eJsonTokenType::OpenBrace);
+        uint64_t start = push_tape_entry(parser, tape, is_object ? eJsonTapeTag::ObjectStart : eJsonTapeTag::ArrayStart, value, 0);
+        if (start != JSON_TAPE_NONE) {
+            parse_json_tape_list(parser, tape, is_object ? eJsonTokenType::CloseBrace : eJsonTokenType::CloseBracket, is_object);
+            uint64_t end = push_tape_entry(parser, tape, is_object ? eJsonTapeTag::ObjectEnd : eJsonTapeTag::ArrayEnd, value, start);
+            uint64_t past_end = (end != JSON_TAPE_NONE) ? (end + 1) : tape->count;
+            tape->words[start] |= past_end;
+        }
+    } break;
+    case eJsonTokenType::StringLiteral:
+        result = push_tape_scalar(parser, tape, eJsonTapeTag::String, value);
+        break;
+    case eJsonTokenType::Number:
+        result = push_tape_scalar(parser, tape, eJsonTapeTag::Number, value);
+        break;
+    case eJsonTokenType::True:
+        result = push_tape_scalar(parser, tape, eJsonTapeTag::True, value);
+        break;
+    case eJsonTokenType::False:
+        result = push_tape_scalar(parser, tape, eJsonTapeTag::False, value);
+        break;
+    case eJsonTokenType::Null:
+        result = push_tape_scalar(parser, tape, eJsonTapeTag::Null, value);
+        break;
+    default:
+        result = false;
+        break;
+    }
+    return result;
+}
+
+// NOTE: the same grammar as parse_json_list, down to its error messages.
+void parse_json_tape_list(json_parser* parser, json_tape* tape, eJsonTokenType end_type, bool has_labels)
+{
+    while (is_parsing(parser)) {
+        json_token value = get_json_token(parser);
+        if (value.type == end_type) {
+            break;
+        }
+        if (has_labels) {
+            if (value.type == eJsonTokenType::StringLiteral) {
+                push_tape_scalar(parser, tape, eJsonTapeTag::Key, value);
+                json_token colon = get_json_token(parser);
+                if (colon.type == eJsonTokenType::Colon)
+                    value = get_json_token(parser);
+                else
+                    error(parser, colon, "Expected colong after field name");
+            } else {
+                error(parser, value, "unexpected token in json");
+            }
+        }
+        if (!parse_json_tape_value(parser, tape, value)) {
+            error(parser, value, "unexpected token in json");
+        }
+
+        json_token comma = get_json_token(parser);
+        if (comma.type == end_type) {
+            break;
+        } else if (comma.type != eJsonTokenType::Comma) {
+            error(parser, comma, "unexpected token in json");
+        }
+    }
+}
+
+// NOTE: every word but the last two of the document stands for at least one
+// byte of the input: a container's two are its brackets, and a key or scalar
+// has at least one character plus the separator after it. So N bytes never
+// need more than N + 2 words. As with make_json_arena, the reservation is
+// only paid for as it is used.
+bool parse_json_tape(buffer input_json, json_tape* tape)
+{
+    TIME_BANDWIDTH(__func__, input_json.count);
+    *tape = {};
+    tape->source = input_json;
+    tape->memory = make_arena((input_json.count + 2) * sizeof(uint64_t));
+    tape->words = (uint64_t*)tape->memory.base;
+
+    json_structural_index index;
+    init_structural_index(&index, input_json);
+    json_parser parser = {};
+    parser.source = input_json;
+    parser.index = &index;
+
+    bool result = (tape->words != nullptr) && parse_json_tape_value(&parser, tape, get_json_token(&parser));
+    return result;
+}
+
+void free_json_tape(json_tape* tape)
+{
+    TIME_FUNCTION;
+    release_arena(&tape->memory);
+    *tape = {};
+}
+
+json_tape_element get_tape_root(json_tape const* tape)
+{
+    json_tape_element result = { tape, tape->count ? 0 : JSON_TAPE_NONE };
+    return result;
+}
+
+bool is_valid(json_tape_element element)
+{
+    return element.index != JSON_TAPE_NONE;
+}
+
+// NOTE: skips the key of an object member, so the result is always a value.
+json_tape_element get_value_at(json_tape const* tape, uint64_t index)
+{
+    json_tape_element result = { tape, JSON_TAPE_NONE };
+    if (index < tape->count) {
+        // NOTE: bad input can leave a key with no value after it.
+        if (get_tag(tape->words[index]) == eJsonTapeTag::Key) {
+            index += 2;
+        }
+        if (index < tape->count) {
+            eJsonTapeTag tag = get_tag(tape->words[index]);
+            if ((tag != eJsonTapeTag::Key) && !is_container_end(tag)) {
+                result.index = index;
+            }
+        }
+    }
+    return result;
+}
+
+json_tape_element first_sub_element(json_tape_element element)
+{
+    json_tape_element result = { element.tape, JSON_TAPE_NONE };
+    if (is_valid(element) && is_container_start(get_tag(element.tape->words[element.index]))) {
+        result = get_value_at(element.tape, element.index + 1);
+    }
+    return result;
+}
+
+json_tape_element next_sibling(json_tape_element element)
+{
+    json_tape_element result = { element.tape, JSON_TAPE_NONE };
+    if (is_valid(element)) {
+        uint64_t word = element.tape->words[element.index];
+        eJsonTapeTag tag = get_tag(word);
+        uint64_t next = is_container_start(tag) ? get_payload(word) : (element.index + get_entry_size(tag));
+        result = get_value_at(element.tape, next);
+    }
+    return result;
+}
+
+buffer get_scalar_text(json_tape const* tape, uint64_t index)
+{
+    buffer result = {};
+    result.data = tape->source.data + get_payload(tape->words[index]);
+    result.count = tape->words[index + 1];
+    return result;
+}
+
+// NOTE: empty for array elements and the root, like json_element::label. A
+// key is always the two words right before its value; a length word never
+// has a tag, so it cannot be mistaken for one.
+buffer get_label(json_tape_element element)
+{
+    buffer result = {};
+    if (is_valid(element) && (element.index >= 2)) {
+        if (get_tag(element.tape->words[element.index - 2]) == eJsonTapeTag::Key) {
+            result = get_scalar_text(element.tape, element.index - 2);
+        }
+    }
+    return result;
+}
+
+// NOTE: the text of a scalar, as in json_element::value. Containers keep no
+// source offset on the tape, so theirs is empty.
+buffer get_value(json_tape_element element)
+{
+    buffer result = {};
+    if (is_valid(element) && is_scalar(get_tag(element.tape->words[element.index]))) {
+        result = get_scalar_text(element.tape, element.index);
+    }
+    return result;
+}
+
+json_tape_element lookup_element(json_tape_element object, buffer element_name)
+{
+    json_tape_element result = { object.tape, JSON_TAPE_NONE };
+    for (json_tape_element search = first_sub_element(object); is_valid(search); search = next_sibling(search)) {
+        if (are_equal(get_label(search), element_name)) {
+            result = search;
+            break;
+        }
+    }
+    return result;
+}
+
+// NOTE: the tape counterpart of read_json_record on a json_element.
+template <typename Record>
+Record read_json_record(json_tape_element object)
+{
+    static_assert(SCHEMA_FIELD_COUNT<Record> <= 32, "fields seen are tracked in a 32-bit mask");
+    Record result = {};
+    json_record_matcher<Record> matcher = {};
+    uint32_t seen = 0;
+    for (json_tape_element member = first_sub_element(object); is_valid(member); member = next_sibling(member)) {
+        uint32_t field_index = match_schema_key(&matcher, get_label(member));
+        if ((field_index < SCHEMA_FIELD_COUNT<Record>) && !(seen & (1u << field_index))) {
+            seen |= 1u << field_index;
+            result.*get_schema_member<Record>(field_index) = convert_number_to_double(get_value(member));
+        }
+    }
+    return result;
+}
+
+// NOTE: the same walk as the linked-DOM parse_haversine_pairs, on a tape.
+template <typename Sink>
+void parse_haversine_pairs_tape(buffer input_json, Sink* output)
+{
+    TIME_FUNCTION;
+    json_tape tape = {};
+    parse_json_tape(input_json, &tape);
+    json_tape_element pairs_array = lookup_element(get_tape_root(&tape), CONSTANT_STRING("pairs"));
+    for (json_tape_element element = first_sub_element(pairs_array); is_valid(element); element = next_sibling(element)) {
+        push_pair(output, read_json_record<haversine_pair>(element));
+    }
+    free_json_tape(&tape);
+}
+
+} // namespace json
@@ -1,33 +1,23 @@
 #include "common.h"
-#include "json_parser.h"
+#include "haversine_math.h"
+#include "json_parallel.h"
+#include "json_stream.h"
+#include "json_tape.h"
+#include "math_check.h"
+#include "pairs_file.h"
+#include "repetition_tester.h"
+#include "sum_window.h"
+#include <fcntl.h>
+#include <getopt.h>
 #include <sys/stat.h>
+#include <unistd.h>
+#include <cstdlib>
+#include <cstring>
 #include <iomanip>
 namespace lsp {
 
-    static double Square(double a) {
-        return a * a;
-    }
-
-    static double RadiansFromDegrees(double degrees) {
-        return 0.01745329251994329577 * degrees;
-    }
-
-static double ReferenceHaversine(double X0, double Y0, double X1, double Y1, double EarthRadius = 6372.8) {
-  double lat1 = Y0, lat2 = Y1, lon1 = X0, lon2 = X1;
-  double dLat = RadiansFromDegrees(lat2 - lat1);
-  double dLon = RadiansFromDegrees(lon2 - lon1);
-  lat1 = RadiansFromDegrees(lat1);
-  lat2 = RadiansFromDegrees(lat2);
-
-  double a = Square(sin(dLat / 2.0)) + cos(lat1) * cos(lat2) * Square(sin(dLon / 2.0));
-  double c = 2.0 * asin(sqrt(a));
-
-  double Result = EarthRadius * c;
-
-  return Result;
-}
-
     static buffer read_entire_file(const char *filename) {
+        TIME_FUNCTION;
         buffer result = {};
         FILE *file = fopen(filename, "rb");
         if (file) {
@@ -35,6 +25,7 @@ static double ReferenceHaversine(double X0, double Y0, double X1, double Y1, dou
             stat(filename, &s);
             result = allocate_buffer(s.st_size);
             if (result.data) {
+                TIME_BANDWIDTH("fread", result.count);
                 if (fread(result.data, result.count, 1, file) != 1) {
                     fprintf(stderr, "Error: unable to read `%s`.\n", filename);
                     free_buffer(&result);
@@ -47,89 +38,692 @@ static double ReferenceHaversine(double X0, double Y0, double X1, double Y1, dou
         return result;
     }
 
-    static double sum_haversine_distances(uint64_t pair_count, haversine_pair *pairs) {
-        double sum = 0;
-        for (uint64_t i = 0; i < pair_count; i++) {
-            haversine_pair pair = pairs[i];
-            constexpr double EARTH_RADIUS = 6372.8;
-            double dist = ReferenceHaversine(pair.x0,
-                                             pair.y0,
-                                             pair.x1,
-                                             pair.y1,
-                                             EARTH_RADIUS);
-            //            std::cout << pair.x0 << " "
-            //                      << pair.y0 << " "
-            //                      << pair.x1 << " "
-            //                      << pair.y1 << " "
-            //                      << dist << std::endl;
-            sum += (dist / pair_count);
-        }
-        return sum;
+    // NOTE: maps the file read-only instead of copying it, so the parser reads
+    // straight out of the page cache. With `populate` every page is faulted in
+    // up front rather than on first touch inside the parse.
+    static buffer map_entire_file(const char *filename, bool populate) {
+        TIME_FUNCTION;
+        buffer result = {};
+        int fd = open(filename, O_RDONLY);
+        if (fd >= 0) {
+            struct stat s = {};
+            fstat(fd, &s);
+            TIME_BANDWIDTH("mmap", s.st_size);
+            result = map_buffer(fd, s.st_size, populate);
+            if (!result.data) {
+                fprintf(stderr, "Error: unable to map `%s`.\n", filename);
+            }
+            close(fd);
+        } else {
+            fprintf(stderr, "Error: unable to open `%s`.\n", filename);
+        }
+        return result;
     }
 
-    
+    enum class eLoadMode {
+        Read,
+        Map,
+        MapPopulate,
+        Stream,
+        Count
+    };
+
+    static const char *load_mode_to_str(eLoadMode mode) {
+        switch (mode) {
+            case eLoadMode::Read: return "read";
+            case eLoadMode::Map: return "mmap";
+            case eLoadMode::MapPopulate: return "populate";
+            case eLoadMode::Stream: return "stream";
+            default: return "unknown";
+        }
+    }
+
+    static bool parse_load_mode(const char *name, eLoadMode *mode) {
+        for (uint32_t i = 0; i < (uint32_t)eLoadMode::Count; ++i) {
+            if (strcmp(name, load_mode_to_str((eLoadMode)i)) == 0) {
+                *mode = (eLoadMode)i;
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // NOTE: Stream never holds the whole file; it is handled by stream_haversine_sum.
+    static buffer load_entire_file(const char *filename, eLoadMode mode) {
+        PERF_PHASE("read");
+        buffer result = {};
+        if (mode == eLoadMode::Read) {
+            result = read_entire_file(filename);
+        } else if (mode != eLoadMode::Stream) {
+            result = map_entire_file(filename, mode == eLoadMode::MapPopulate);
+        }
+        return result;
+    }
+
+    enum class eParseMode {
+        Dom,
+        Tape,
+        Events,
+        Parallel,
+        Fused,
+        Count
+    };
+
+    static const char *parse_mode_to_str(eParseMode mode) {
+        switch (mode) {
+            case eParseMode::Dom: return "dom";
+            case eParseMode::Tape: return "tape";
+            case eParseMode::Events: return "events";
+            case eParseMode::Parallel: return "parallel";
+            case eParseMode::Fused: return "fused";
+            default: return "unknown";
+        }
+    }
+
+    static bool parse_parse_mode(const char *name, eParseMode *mode) {
+        for (uint32_t i = 0; i < (uint32_t)eParseMode::Count; ++i) {
+            if (strcmp(name, parse_mode_to_str((eParseMode)i)) == 0) {
+                *mode = (eParseMode)i;
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // NOTE: Fused never produces the pairs; see fuse_haversine_sum.
+    static uint64_t parse_haversine_pairs(thread_pool *pool, buffer input_json, haversine_pairs_soa *pairs, eParseMode mode) {
+        PERF_PHASE("parse");
+        pairs->count = 0;
+        if (mode == eParseMode::Dom) {
+            json::parse_haversine_pairs(input_json, pairs);
+        } else if (mode == eParseMode::Tape) {
+            json::parse_haversine_pairs_tape(input_json, pairs);
+        } else if (mode == eParseMode::Events) {
+            json::parse_haversine_pairs_events(input_json, pairs);
+        } else {
+            json::parse_haversine_pairs_parallel(pool, input_json, pairs);
+        }
+        pad_pairs_soa(pairs);
+        trim_pairs_soa(pairs);
+        return pairs->count;
+    }
+
+    static bool parse_commit_policy(const char *name, eCommitPolicy *policy) {
+        for (uint32_t i = 0; i < (uint32_t)eCommitPolicy::Count; ++i) {
+            if (strcmp(name, commit_policy_to_str((eCommitPolicy)i)) == 0) {
+                *policy = (eCommitPolicy)i;
+                return true;
+            }
+        }
+        return false;
+    }
+
+    static uint64_t get_file_size(char const *filename) {
+        struct stat s = {};
+        uint64_t result = (stat(filename, &s) == 0) ? s.st_size : 0;
+        return result;
+    }
+
+    struct run_config {
+        char const *input_path;
+        char const *answers_path;
+        char const *convert_path;
+        uint32_t repeat_seconds;
+        eLoadMode load_mode;
+        eParseMode parse_mode;
+        stream_options stream;
+        uint64_t memory_cap;
+        eCommitPolicy commit_policy;
+        eIsaLevel isa_level;
+        uint32_t thread_count;
+        bool math_check;
+        bool parse_check;
+        bool counters;
+    };
+
+    // NOTE: every kernel pointer that is picked by instruction set, so that
+    // --isa moves all of them to the same level together.
+    static void bind_isa_kernels(eIsaLevel level) {
+        json::global_json_classify_block = json::select_json_classify_block(level);
+        global_haversine_sum = select_haversine_sum(level);
+    }
+
+    static haversine_sum_window make_stream_window(thread_pool *pool, run_config const &config) {
+        haversine_sum_window result = (config.parse_mode == eParseMode::Fused) ? make_fused_sum_window()
+                                                                                : make_sum_window(pool, config.memory_cap);
+        return result;
+    }
+
+    // NOTE: parses, sums and drops the pairs window by window, so memory stays
+    // under config.memory_cap however large the input is. `input_size` is
+    // set at the end, since for a pipe it is only known once it is drained.
+    static bool stream_haversine_sum(thread_pool *pool, run_config const &config, uint64_t *input_size, uint64_t *pair_count, double *sum) {
+        PERF_PHASE("stream");
+        file_stream stream = {};
+        bool result = open_file_stream(&stream, config.input_path, config.stream);
+        if (result) {
+            haversine_sum_window window = make_stream_window(pool, config);
+            result = (window.pairs.capacity != 0);
+            if (result) {
+                json::stream_haversine_pairs(&stream, &window);
+                double total = finish_sum_window(&window);
+                *pair_count = window.pair_count;
+                *sum = window.pair_count ? (total / window.pair_count) : 0;
+            }
+            *input_size = stream.file_size;
+            free_sum_window(&window);
+            close_file_stream(&stream);
+        }
+        return result;
+    }
+
+    // NOTE: every pair is summed while its bytes are still in cache, one
+    // L1-sized block at a time, and no pairs array is ever written.
+    static double fuse_haversine_sum(buffer input_json, uint64_t *pair_count) {
+        PERF_PHASE("fused");
+        TIME_BANDWIDTH(__func__, input_json.count);
+        double result = 0;
+        haversine_sum_window window = make_fused_sum_window();
+        if (window.pairs.capacity) {
+            json::parse_haversine_pairs_events(input_json, &window);
+            double total = finish_sum_window(&window);
+            result = window.pair_count ? (total / window.pair_count) : 0;
+        }
+        *pair_count = window.pair_count;
+        free_sum_window(&window);
+        return result;
+    }
+
+    // NOTE: a binary pairs file (see pairs_file.h) is recognized by its magic
+    // and mapped as is; anything else is parsed as JSON.
+    static bool load_haversine_pairs(thread_pool *pool, run_config const &config, haversine_pairs_soa *pairs, uint64_t *input_size) {
+        bool result = false;
+        *pairs = {};
+        if (is_pairs_file(config.input_path)) {
+            *input_size = get_file_size(config.input_path);
+            PERF_PHASE("read");
+            result = load_pairs_file(config.input_path, config.load_mode == eLoadMode::MapPopulate, pairs);
+        } else {
+            buffer input_json = load_entire_file(config.input_path, config.load_mode);
+            *input_size = input_json.count;
+            uint64_t max_pair_count = *input_size / HAVERSINE_MIN_JSON_PAIR_BYTES;
+            if (max_pair_count) {
+                *pairs = reserve_pairs_soa(max_pair_count, config.commit_policy);
+                if (pairs->capacity) {
+                    parse_haversine_pairs(pool, input_json, pairs, config.parse_mode);
+                }
+                result = (pairs->capacity != 0);
+            } else {
+                fprintf(stderr, "ERROR: Malformed input JSON\n");
+            }
+            free_buffer(&input_json);
+        }
+        return result;
+    }
+
+    static double sum_haversine_distances(thread_pool *pool, haversine_pairs_soa const *pairs, haversine_sum_fn sum_distances = global_haversine_sum) {
+        TIME_BANDWIDTH(__func__, pairs->count * sizeof(haversine_pair));
+        PERF_PHASE("sum");
+        double result = 0;
+        if (pairs->count) {
+            result = sum_haversine_blocks(pool, pairs, sum_distances) / pairs->count;
+        }
+        return result;
+    }
+
+    static bool parse_command_line(int argc, char **argv, run_config *config) {
+        const static option long_options[] = {
+            {"repeat", required_argument, 0, 'r'},
+            {"load", required_argument, 0, 'l'},
+            {"parser", required_argument, 0, 'p'},
+            {"threads", required_argument, 0, 't'},
+            {"io", required_argument, 0, 'i'},
+            {"direct", no_argument, 0, 'd'},
+            {"convert", required_argument, 0, 'c'},
+            {"memory-cap", required_argument, 0, 'M'},
+            {"math-check", no_argument, 0, 'm'},
+            {"parse-check", no_argument, 0, 'k'},
+            {"counters", no_argument, 0, 'C'},
+            {"commit", required_argument, 0, 'P'},
+            {"isa", required_argument, 0, 'I'},
+            {0, 0, 0, 0}
+        };
+        *config = {};
+        config->load_mode = eLoadMode::Map;
+        config->parse_mode = eParseMode::Parallel;
+        config->thread_count = std::thread::hardware_concurrency();
+        config->memory_cap = DEFAULT_MEMORY_CAP;
+        config->isa_level = get_best_isa_level();
+        int c = 0;
+        while ((c = getopt_long(argc, argv, "r:l:p:t:i:dc:M:mkCP:I:", long_options, 0)) != -1) {
+            switch (c) {
+                case 'r': config->repeat_seconds = (uint32_t)strtoul(optarg, 0, 10); break;
+                case 'l': {
+                    if (!parse_load_mode(optarg, &config->load_mode)) {
+                        fprintf(stderr, "ERROR: Unknown load mode `%s`.\n", optarg);
+                        return false;
+                    }
+                } break;
+                case 'p': {
+                    if (!parse_parse_mode(optarg, &config->parse_mode)) {
+                        fprintf(stderr, "ERROR: Unknown parser `%s`.\n", optarg);
+                        return false;
+                    }
+                } break;
+                case 't': config->thread_count = (uint32_t)strtoul(optarg, 0, 10); break;
+                case 'i': {
+                    if (!parse_stream_backend(optarg, &config->stream.backend)) {
+                        fprintf(stderr, "ERROR: Unknown io backend `%s`.\n", optarg);
+                        return false;
+                    }
+                } break;
+                case 'd': config->stream.direct = true; break;
+                case 'c': config->convert_path = optarg; break;
+                case 'M': config->memory_cap = strtoull(optarg, 0, 10) * 1024 * 1024; break;
+                case 'm': config->math_check = true; break;
+                case 'k': config->parse_check = true; break;
+                case 'C': config->counters = true; break;
+                case 'P': {
+                    if (!parse_commit_policy(optarg, &config->commit_policy)) {
+                        fprintf(stderr, "ERROR: Unknown commit policy `%s`.\n", optarg);
+                        return false;
+                    }
+                } break;
+                case 'I': {
+                    if (!parse_isa_level(optarg, &config->isa_level)) {
+                        fprintf(stderr, "ERROR: Unknown instruction set `%s`.\n", optarg);
+                        return false;
+                    }
+                    if (!is_isa_level_supported(config->isa_level)) {
+                        fprintf(stderr, "ERROR: This CPU does not support %s (best is %s).\n", optarg,
+                                isa_level_to_str(get_best_isa_level()));
+                        return false;
+                    }
+                } break;
+                default: return false;
+            }
+        }
+        if (!config->thread_count) {
+            config->thread_count = 1;
+        }
+        int positional_count = argc - optind;
+        if (config->math_check) {
+            return positional_count == 0;
+        }
+        if (config->parse_check) {
+            config->input_path = (positional_count == 1) ? argv[optind] : 0;
+            if (config->input_path && is_sequential_input(config->input_path)) {
+                fprintf(stderr, "ERROR: --parse-check reads the input once per parse mode and needs a regular file.\n");
+                return false;
+            }
+            return positional_count <= 1;
+        }
+        if ((positional_count != 1) && (positional_count != 2)) {
+            return false;
+        }
+        config->input_path = argv[optind];
+        config->answers_path = (positional_count == 2) ? argv[optind + 1] : 0;
+        // NOTE: stdin ("-") and pipes can only be read once and may never end,
+        // so they are always streamed.
+        if (is_sequential_input(config->input_path)) {
+            if (config->repeat_seconds) {
+                fprintf(stderr, "ERROR: --repeat reads the input many times and needs a regular file.\n");
+                return false;
+            }
+            config->load_mode = eLoadMode::Stream;
+        }
+        if (config->convert_path && ((config->load_mode == eLoadMode::Stream) || (config->parse_mode == eParseMode::Fused))) {
+            fprintf(stderr, "ERROR: --convert needs every pair in memory and cannot be used with --load stream, --parser fused or a pipe.\n");
+            return false;
+        }
+        return true;
+    }
+
+    // NOTE: every parse mode fills the same SoA in turn, the way the parse
+    // waves of --repeat reuse it, and each has to give the pairs the first one
+    // did. This catches a mode that depends on state an earlier one left
+    // behind, such as how much of the SoA counts as committed. Fused sums in
+    // its own order, so its sum only has to agree to rounding.
+    static bool check_parse_modes(thread_pool *pool, char const *name, buffer input_json, haversine_pairs_soa *pairs) {
+        printf("\n--- parse modes on one SoA (%s) ---\n", name);
+        bool result = true;
+        uint64_t expected_count = 0;
+        double expected_sum = 0;
+        for (uint32_t mode = 0; mode <= (uint32_t)eParseMode::Fused; ++mode) {
+            uint64_t pair_count = 0;
+            double sum = 0;
+            bool is_ok = true;
+            if (mode == (uint32_t)eParseMode::Fused) {
+                sum = fuse_haversine_sum(input_json, &pair_count);
+                is_ok = (pair_count == expected_count) && (fabs(sum - expected_sum) <= 1e-12 * fabs(expected_sum));
+            } else {
+                pair_count = parse_haversine_pairs(pool, input_json, pairs, (eParseMode)mode);
+                sum = sum_haversine_distances(pool, pairs);
+                if (mode == 0) {
+                    expected_count = pair_count;
+                    expected_sum = sum;
+                }
+                is_ok = (pair_count == expected_count) && (sum == expected_sum);
+            }
+            printf("%-10s %12llu %24.16f %8s\n", parse_mode_to_str((eParseMode)mode), pair_count, sum, is_ok ? "ok" : "FAILED");
+            result = result && is_ok;
+        }
+        return result;
+    }
+
+    // NOTE: repeated fields in a pair and a second "pairs" array; the first
+    // occurrence of each is the one every parse mode has to read.
+    static char const DUPLICATE_KEYS_JSON[] =
+        "{\"pairs\":[{\"x0\":10,\"y0\":20,\"x1\":30,\"y1\":40,\"x0\":-170,\"y1\":-80},"
+        "{\"y0\":1,\"x0\":2,\"y0\":89,\"x1\":3,\"y1\":4,\"x1\":179}],"
+        "\"pairs\":[{\"x0\":0,\"y0\":0,\"x1\":90,\"y1\":0}]}";
+
+    static bool check_duplicate_keys(thread_pool *pool) {
+        bool result = false;
+        buffer input_json = allocate_buffer(sizeof(DUPLICATE_KEYS_JSON) - 1);
+        haversine_pairs_soa pairs = allocate_pairs_soa(input_json.count / HAVERSINE_MIN_JSON_PAIR_BYTES);
+        if (input_json.data && pairs.capacity) {
+            memcpy(input_json.data, DUPLICATE_KEYS_JSON, input_json.count);
+            result = check_parse_modes(pool, "duplicate keys", input_json, &pairs);
+        }
+        free_pairs_soa(&pairs);
+        free_buffer(&input_json);
+        return result;
+    }
+
+    // NOTE: --parse-check; the built-in inputs, and the given file if there
+    // is one, each into a fresh SoA as the parse tests use. Kept out of
+    // --repeat so that none of it runs next to the timed waves.
+    static bool run_parse_check(run_config const &config, thread_pool *pool) {
+        bool result = check_duplicate_keys(pool);
+        if (config.input_path) {
+            eLoadMode load_mode = (config.load_mode == eLoadMode::Stream) ? eLoadMode::Map : config.load_mode;
+            buffer input_json = load_entire_file(config.input_path, load_mode);
+            haversine_pairs_soa pairs = allocate_pairs_soa(input_json.count / HAVERSINE_MIN_JSON_PAIR_BYTES);
+            if (input_json.count && pairs.capacity) {
+                result = check_parse_modes(pool, config.input_path, input_json, &pairs) && result;
+            } else {
+                fprintf(stderr, "ERROR: Malformed input JSON\n");
+                result = false;
+            }
+            free_pairs_soa(&pairs);
+            free_buffer(&input_json);
+        }
+        return result;
+    }
+
+    // NOTE: each phase is tested on its own wave, with its inputs prepared up
+    // front, so that a wave only ever times the code under test.
+    static void run_parse_tests(run_config const &config, thread_pool *pool, uint64_t cpu_timer_freq, haversine_pairs_soa *pairs) {
+        // NOTE: the parsers themselves are timed on a mapped file when streaming.
+        eLoadMode load_mode = (config.load_mode == eLoadMode::Stream) ? eLoadMode::Map : config.load_mode;
+        buffer input_json = load_entire_file(config.input_path, load_mode);
+        uint64_t max_pair_count = input_json.count / HAVERSINE_MIN_JSON_PAIR_BYTES;
+        *pairs = allocate_pairs_soa(max_pair_count);
+        if (max_pair_count && pairs->capacity) {
+            repetition_tester tester = {};
+
+            for (uint32_t mode = 0; mode < (uint32_t)eLoadMode::Stream; ++mode) {
+                printf("\n--- load_entire_file (%s) ---\n", load_mode_to_str((eLoadMode)mode));
+                tester = {};
+                new_test_wave(&tester, input_json.count, cpu_timer_freq, config.repeat_seconds);
+                while (is_testing(&tester)) {
+                    begin_time(&tester);
+                    buffer file = load_entire_file(config.input_path, (eLoadMode)mode);
+                    end_time(&tester);
+                    count_bytes(&tester, file.count);
+                    free_buffer(&file);
+                }
+            }
+
+            for (uint32_t mode = 0; mode < (uint32_t)eParseMode::Fused; ++mode) {
+                printf("\n--- parse_haversine_pairs (%s, %s) ---\n", parse_mode_to_str((eParseMode)mode),
+                       load_mode_to_str(load_mode));
+                tester = {};
+                new_test_wave(&tester, input_json.count, cpu_timer_freq, config.repeat_seconds);
+                while (is_testing(&tester)) {
+                    begin_time(&tester);
+                    parse_haversine_pairs(pool, input_json, pairs, (eParseMode)mode);
+                    end_time(&tester);
+                    count_bytes(&tester, input_json.count);
+                }
+            }
+
+            printf("\n--- fuse_haversine_sum (%s) ---\n", load_mode_to_str(load_mode));
+            tester = {};
+            new_test_wave(&tester, input_json.count, cpu_timer_freq, config.repeat_seconds);
+            while (is_testing(&tester)) {
+                uint64_t pair_count = 0;
+                begin_time(&tester);
+                volatile double sum = fuse_haversine_sum(input_json, &pair_count);
+                end_time(&tester);
+                count_bytes(&tester, input_json.count);
+                (void)sum;
+            }
+
+            printf("\n--- stream_haversine_sum (%s%s, %llu MB cap) ---\n", stream_backend_to_str(config.stream.backend),
+                   config.stream.direct ? ", direct" : "", config.memory_cap / (1024 * 1024));
+            tester = {};
+            new_test_wave(&tester, input_json.count, cpu_timer_freq, config.repeat_seconds);
+            while (is_testing(&tester)) {
+                uint64_t input_size = 0;
+                uint64_t pair_count = 0;
+                double sum = 0;
+                begin_time(&tester);
+                stream_haversine_sum(pool, config, &input_size, &pair_count, &sum);
+                end_time(&tester);
+                count_bytes(&tester, input_json.count);
+            }
+        } else {
+            fprintf(stderr, "ERROR: Malformed input JSON\n");
+            free_pairs_soa(pairs);
+        }
+        free_buffer(&input_json);
+    }
+
+    static void run_pairs_file_tests(run_config const &config, uint64_t cpu_timer_freq, haversine_pairs_soa *pairs) {
+        bool populate = (config.load_mode == eLoadMode::MapPopulate);
+        uint64_t file_size = get_file_size(config.input_path);
+        printf("\n--- load_pairs_file (%s) ---\n", populate ? "populate" : "mmap");
+        repetition_tester tester = {};
+        new_test_wave(&tester, file_size, cpu_timer_freq, config.repeat_seconds);
+        while (is_testing(&tester)) {
+            begin_time(&tester);
+            haversine_pairs_soa loaded = {};
+            load_pairs_file(config.input_path, populate, &loaded);
+            end_time(&tester);
+            count_bytes(&tester, file_size);
+            free_pairs_soa(&loaded);
+        }
+        load_pairs_file(config.input_path, populate, pairs);
+    }
+
+    static void run_repetition_tests(run_config const &config, thread_pool *pool) {
+        uint64_t cpu_timer_freq = estimate_cpu_timer_freq();
+        haversine_pairs_soa pairs = {};
+        if (is_pairs_file(config.input_path)) {
+            run_pairs_file_tests(config, cpu_timer_freq, &pairs);
+        } else {
+            run_parse_tests(config, pool, cpu_timer_freq, &pairs);
+        }
+
+        if (pairs.capacity) {
+            struct {
+                char const *name;
+                haversine_sum_fn sum_distances;
+                bool is_supported;
+            } kernels[] = {
+                {"scalar", sum_haversine_soa_scalar, true},
+                {"avx2", sum_haversine_soa_avx2<>, config.isa_level >= eIsaLevel::Avx2},
+                {"avx512", sum_haversine_soa_avx512<>, config.isa_level >= eIsaLevel::Avx512},
+            };
+            uint64_t pair_bytes = pairs.count * sizeof(haversine_pair);
+            for (auto const &kernel : kernels) {
+                if (!kernel.is_supported) {
+                    continue;
+                }
+                printf("\n--- sum_haversine_distances (%s, %u threads) ---\n", kernel.name, get_thread_count(pool));
+                repetition_tester tester = {};
+                new_test_wave(&tester, pair_bytes, cpu_timer_freq, config.repeat_seconds);
+                while (is_testing(&tester)) {
+                    begin_time(&tester);
+                    volatile double sum = sum_haversine_distances(pool, &pairs, kernel.sum_distances);
+                    end_time(&tester);
+                    count_bytes(&tester, pair_bytes);
+                    (void)sum;
+                }
+            }
+        }
+
+        free_pairs_soa(&pairs);
+    }
 }
 int main(int argc, char **argv)
 {
+    lsp::begin_profile();
     int result = 1;
-    if((argc == 2) || (argc == 3))
+    lsp::run_config config = {};
+    bool is_valid = lsp::parse_command_line(argc, argv, &config);
+    lsp::thread_pool pool;
+    if(is_valid)
+    {
+        lsp::bind_isa_kernels(config.isa_level);
+    }
+    // NOTE: only for a single run; the repetition tester keeps its own time.
+    if(is_valid && config.counters && !config.repeat_seconds && !config.math_check && !config.parse_check)
+    {
+        lsp::open_perf_counters();
+    }
+    lsp::start_thread_pool(&pool, is_valid ? config.thread_count : 1);
+    if(is_valid && config.math_check)
+    {
+        lsp::run_math_check();
+        result = 0;
+    }
+    else if(is_valid && config.parse_check)
+    {
+        result = lsp::run_parse_check(config, &pool) ? 0 : 1;
+    }
+    else if(is_valid && config.repeat_seconds)
     {
-        buffer input_json = lsp::read_entire_file(argv[1]);
-        unsigned min_json_pair_encoding = 6*4;
-        uint64_t max_pair_count = input_json.count / min_json_pair_encoding;
-        if(max_pair_count)
+        lsp::run_repetition_tests(config, &pool);
+        result = 0;
+    }
+    else if(is_valid && config.input_path)
+    {
+        uint64_t input_size = 0;
+        uint64_t pair_count = 0;
+        double sum = 0;
+        bool is_loaded = false;
+        haversine_pairs_soa pairs = {};
+        bool is_json = lsp::is_sequential_input(config.input_path) || !is_pairs_file(config.input_path);
+        if(is_json && (config.load_mode == lsp::eLoadMode::Stream))
+        {
+            is_loaded = lsp::stream_haversine_sum(&pool, config, &input_size, &pair_count, &sum);
+        }
+        else if(is_json && (config.parse_mode == lsp::eParseMode::Fused))
+        {
+            buffer input_json = lsp::load_entire_file(config.input_path, config.load_mode);
+            input_size = input_json.count;
+            is_loaded = (input_json.data != 0);
+            sum = lsp::fuse_haversine_sum(input_json, &pair_count);
+            free_buffer(&input_json);
+        }
+        else if(lsp::load_haversine_pairs(&pool, config, &pairs, &input_size))
+        {
+            is_loaded = true;
+            pair_count = pairs.count;
+            sum = lsp::sum_haversine_distances(&pool, &pairs);
+        }
+        
+        if(is_loaded)
         {
-            buffer parsed_values = allocate_buffer(max_pair_count * sizeof(haversine_pair));
-            if(parsed_values.count)
+            fprintf(stdout, "Input size: %llu\n", input_size);
+            fprintf(stdout, "Pair count: %llu\n", pair_count);
+            fprintf(stdout, "Haversine sum: %.16f\n", sum);
+            fprintf(stdout, "Kernels: %s\n", lsp::isa_level_to_str(config.isa_level));
+            if(global_commit_stats.reserved_bytes)
             {
-                haversine_pair *pairs = (haversine_pair *)parsed_values.data;
-                uint64_t pair_count = json::parse_haversine_pairs(input_json, max_pair_count, pairs);
-                double sum = lsp::sum_haversine_distances(pair_count, pairs);
-                
-                fprintf(stdout, "Input size: %llu\n", input_json.count);
-                fprintf(stdout, "Pair count: %llu\n", pair_count);
-                fprintf(stdout, "Haversine sum: %.16f\n", sum);
-                
-                if(argc == 3)
+                double megabyte = 1024.0 * 1024.0;
+                fprintf(stdout, "Pairs memory (%s): %.1fmb committed, %.1fmb peak, %.1fmb reserved, %llu commits, %llu faults while committing\n",
+                        commit_policy_to_str(config.commit_policy), global_commit_stats.committed_bytes / megabyte,
+                        global_commit_stats.peak_committed_bytes / megabyte, global_commit_stats.reserved_bytes / megabyte,
+                        global_commit_stats.commit_count, global_commit_stats.commit_page_faults);
+            }
+            
+            if(config.convert_path && write_pairs_file(config.convert_path, &pairs))
+            {
+                fprintf(stdout, "Wrote pairs file: %s\n", config.convert_path);
+            }
+            
+            if(config.answers_path)
+            {
+                buffer answers_double = lsp::read_entire_file(config.answers_path);
+                if(answers_double.count >= sizeof(double))
                 {
-                    buffer answers_double = lsp::read_entire_file(argv[2]);
-                    if(answers_double.count >= sizeof(double))
+                    double *answer_values = (double *)answers_double.data;
+                    
+                    fprintf(stdout, "\nValidation:\n");
+                    
+                    uint64_t ref_answer_count = (answers_double.count - sizeof(double)) / sizeof(double);
+                    if(pair_count != ref_answer_count)
+                    {
+                        fprintf(stdout, "FAILED - pair count doesn't match %llu.\n", ref_answer_count);
+                    }
+                    
+                    // NOTE: the generator prints shortest round-trip doubles, so a correct
+                    // parse gives back the exact inputs and ReferenceHaversine the exact
+                    // answers; any mismatched bit is a parse error, not rounding.
+                    if(pairs.count && (pairs.count == ref_answer_count))
                     {
-                        double *answer_values = (double *)answers_double.data;
-                        
-                        fprintf(stdout, "\nValidation:\n");
-                        
-                        uint64_t ref_answer_count = (answers_double.count - sizeof(double)) / sizeof(double);
-                        if(pair_count != ref_answer_count)
+                        uint64_t exact_count = 0;
+                        for(uint64_t i = 0; i < pairs.count; ++i)
                         {
-                            fprintf(stdout, "FAILED - pair count doesn't match %llu.\n", ref_answer_count);
+                            double distance = lsp::ReferenceHaversine(pairs.x0[i], pairs.y0[i], pairs.x1[i], pairs.y1[i]);
+                            exact_count += (memcmp(&distance, &answer_values[i], sizeof(double)) == 0);
                         }
-                        
-                        double ref_sum = answer_values[ref_answer_count];
-                        fprintf(stdout, "Reference sum: %.16f\n", ref_sum);
-                        fprintf(stdout, "Difference: %.16f\n", sum - ref_sum);
-                        
-                        fprintf(stdout, "\n");
+                        fprintf(stdout, "Exact answers: %llu/%llu\n", exact_count, pairs.count);
                     }
+
+                    double ref_sum = answer_values[ref_answer_count];
+                    fprintf(stdout, "Reference sum: %.16f\n", ref_sum);
+                    fprintf(stdout, "Difference: %.16f\n", sum - ref_sum);
+                    
+                    fprintf(stdout, "\n");
                 }
             }
-            
-            free_buffer(&parsed_values);
-        }
-        else
-        {
-            fprintf(stderr, "ERROR: Malformed input JSON\n");
         }
-
-        free_buffer(&input_json);
+        
+        free_pairs_soa(&pairs);
         
         result = 0;
+        lsp::end_and_print_profile();
     }
     else
     {
         fprintf(stderr, "Usage: %s [haversine_input.json]\n", argv[0]);
         fprintf(stderr, "       %s [haversine_input.json] [answers.double]\n", argv[0]);
+        fprintf(stderr, "       %s --repeat <seconds> [haversine_input.json]\n", argv[0]);
+        fprintf(stderr, "       %s [haversine_input.json] --convert [pairs.bin]\n", argv[0]);
+        fprintf(stderr, "       %s [pairs.bin] [answers.double]\n", argv[0]);
+        fprintf(stderr, "       haversine_input ... --output - | %s - (stdin and pipes are streamed)\n", argv[0]);
+        fprintf(stderr, "       %s --math-check\n", argv[0]);
+        fprintf(stderr, "       %s --parse-check [haversine_input.json]\n", argv[0]);
+        fprintf(stderr, "Options: --load [read|mmap|populate|stream] (default mmap)\n");
+        fprintf(stderr, "         --parser [dom|tape|events|parallel|fused] (default parallel)\n");
+        fprintf(stderr, "         --threads <count> (default: one per core)\n");
+        fprintf(stderr, "         --io [thread|uring] (default thread, with --load stream)\n");
+        fprintf(stderr, "         --direct (O_DIRECT reads, with --load stream)\n");
+        fprintf(stderr, "         --memory-cap <MB> (default 64, with --load stream)\n");
+        fprintf(stderr, "         --counters (perf_event_open counters per phase)\n");
+        fprintf(stderr, "         --commit [lazy|populate|huge|huge-populate] (default lazy, pairs array paging)\n");
+        fprintf(stderr, "         --isa [scalar|sse4.2|avx2|avx512] (default: best this CPU supports)\n");
     }
+
+    lsp::stop_thread_pool(&pool);
+    lsp::close_perf_counters();
     
     return result;
 }
+
+PROFILER_END_OF_COMPILATION_UNIT;
@@ -0,0 +1,336 @@
+#pragma once
+#include "haversine_math.h"
+#include "platform_metrics.h"
+#include <cfloat>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+
+namespace lsp {
+
+    // Accuracy harness for the approximations in haversine_math.h. Each
+    // function is swept over the whole input domain ReferenceHaversine gives
+    // it (latitudes of +-90 degrees, longitude deltas of +-360 degrees, halved)
+    // and compared against libm, one row per polynomial size, so the cost of
+    // every term can be read off directly.
+    constexpr uint64_t MATH_CHECK_SAMPLE_COUNT = 1 << 20;
+    constexpr uint32_t MATH_CHECK_TIMING_PASSES = 32;
+
+    struct math_check_domain {
+        char const *name;
+        double min;
+        double max;
+    };
+
+    struct math_check_result {
+        double max_abs_error;
+        double max_abs_error_input;
+        uint64_t max_ulp_error;
+        double max_ulp_error_input;
+        double cycles_per_call;
+    };
+
+    struct math_check_samples {
+        double *inputs;
+        double *reference;
+    };
+
+    static uint64_t ordered_bits(double value) {
+        uint64_t bits = 0;
+        memcpy(&bits, &value, sizeof(bits));
+        // NOTE: maps doubles onto integers that sort the same way, so the
+        // distance between two of them is the number of doubles in between.
+        return (bits & 0x8000000000000000ull) ? ~bits : (bits | 0x8000000000000000ull);
+    }
+
+    static uint64_t ulp_distance(double a, double b) {
+        uint64_t ia = ordered_bits(a);
+        uint64_t ib = ordered_bits(b);
+        return (ia > ib) ? (ia - ib) : (ib - ia);
+    }
+
+    template <typename Function>
+    static double time_math_function(math_check_samples const &samples, Function function) {
+        uint64_t best = UINT64_MAX;
+        for (uint32_t pass = 0; pass < MATH_CHECK_TIMING_PASSES; ++pass) {
+            double sum = 0;
+            uint64_t start = read_cpu_timer();
+            for (uint64_t i = 0; i < MATH_CHECK_SAMPLE_COUNT; ++i) {
+                sum += function(samples.inputs[i]);
+            }
+            uint64_t elapsed = read_cpu_timer() - start;
+            volatile double sink = sum;
+            (void)sink;
+            if (elapsed < best) {
+                best = elapsed;
+            }
+        }
+        return (double)best / MATH_CHECK_SAMPLE_COUNT;
+    }
+
+    template <typename Function>
+    static math_check_result check_math_function(math_check_samples const &samples, Function approx) {
+        math_check_result result = {};
+        for (uint64_t i = 0; i < MATH_CHECK_SAMPLE_COUNT; ++i) {
+            double input = samples.inputs[i];
+            double value = approx(input);
+            double expected = samples.reference[i];
+            double abs_error = fabs(value - expected);
+            uint64_t ulp_error = ulp_distance(value, expected);
+            if (abs_error > result.max_abs_error) {
+                result.max_abs_error = abs_error;
+                result.max_abs_error_input = input;
+            }
+            if (ulp_error > result.max_ulp_error) {
+                result.max_ulp_error = ulp_error;
+                result.max_ulp_error_input = input;
+            }
+        }
+        result.cycles_per_call = time_math_function(samples, approx);
+        return result;
+    }
+
+    template <typename Function>
+    static void prepare_math_check(math_check_samples *samples, math_check_domain const &domain, Function reference) {
+        for (uint64_t i = 0; i < MATH_CHECK_SAMPLE_COUNT; ++i) {
+            double t = (double)i / (double)(MATH_CHECK_SAMPLE_COUNT - 1);
+            double input = domain.min + t * (domain.max - domain.min);
+            samples->inputs[i] = input;
+            samples->reference[i] = reference(input);
+        }
+        printf("\n--- %s over [%.17g, %.17g] ---\n", domain.name, domain.min, domain.max);
+        printf("%-10s %12s %22s %14s %22s %12s\n", "variant", "max abs", "at", "max ulp", "at", "cycles/call");
+        printf("%-10s %12s %22s %14s %22s %12.2f\n", "libm", "-", "-", "-", "-", time_math_function(*samples, reference));
+    }
+
+    static void print_math_check_row(char const *label, uint32_t size, math_check_result const &result) {
+        char variant[32];
+        snprintf(variant, sizeof(variant), "%s %u", label, size);
+        printf("%-10s %12.3e %22.17g %14llu %22.17g %12.2f\n", variant, result.max_abs_error, result.max_abs_error_input,
+               result.max_ulp_error, result.max_ulp_error_input, result.cycles_per_call);
+    }
+
+    template <uint32_t Terms>
+    static void check_sin_fits(math_check_samples const &samples) {
+        print_math_check_row("terms", Terms, check_math_function(samples, [](double x) { return sin_approx<Terms>(x); }));
+        if constexpr (Terms < HAVERSINE_SIN_MAX_TERMS) {
+            check_sin_fits<Terms + 1>(samples);
+        }
+    }
+
+    template <uint32_t Terms>
+    static void check_cos_fits(math_check_samples const &samples) {
+        print_math_check_row("terms", Terms, check_math_function(samples, [](double x) { return cos_approx<Terms>(x); }));
+        if constexpr (Terms < HAVERSINE_SIN_MAX_TERMS) {
+            check_cos_fits<Terms + 1>(samples);
+        }
+    }
+
+    template <uint32_t Terms>
+    static void check_asin_fits(math_check_samples const &samples) {
+        print_math_check_row("terms", Terms, check_math_function(samples, [](double x) { return asin_approx<Terms>(x); }));
+        if constexpr (Terms < HAVERSINE_ASIN_MAX_TERMS) {
+            check_asin_fits<Terms + 1>(samples);
+        }
+    }
+
+    template <uint32_t Steps>
+    static void check_sqrt_steps(math_check_samples const &samples) {
+        print_math_check_row("steps", Steps, check_math_function(samples, [](double x) { return sqrt_approx<Steps>(x); }));
+        if constexpr (Steps < 5) {
+            check_sqrt_steps<Steps + 1>(samples);
+        }
+    }
+
+    // NOTE: the full kernels are checked too, not just the scalar versions of
+    // their polynomials above, so a kernel that is wired to the wrong fit or
+    // folds an argument differently shows up here. haversine_kernel_mirror
+    // repeats the kernels' arithmetic one lane at a time, fused multiply-adds
+    // included, with the configured fits; every kernel has to reproduce it to
+    // the bit. Every distance also has to be within the documented tolerance
+    // of ReferenceHaversine (rel/tol at most 1), and so does their sum.
+    constexpr uint64_t MATH_CHECK_PAIR_COUNT = 1 << 16;
+    constexpr double HAVERSINE_AVERAGE_TOLERANCE = 1e-12;
+
+    // NOTE: the relative tolerance for a distance, as documented next to the
+    // fits in haversine_math.h.
+    static double haversine_kernel_tolerance(double distance) {
+        double conditioning = fabs(cos(distance / (2.0 * EARTH_RADIUS)));
+        double floor = sqrt(DBL_EPSILON);
+        return 8.0 * DBL_EPSILON / ((conditioning > floor) ? conditioning : floor);
+    }
+
+    static double evaluate_polynomial_fma(double t, double const *coefficients, uint32_t count) {
+        double result = coefficients[count - 1];
+        for (uint32_t i = count - 1; i > 0; --i) {
+            result = fma(result, t, coefficients[i - 1]);
+        }
+        return result;
+    }
+
+    template <uint32_t Terms>
+    static double sin_kernel_mirror(double x) {
+        return x * evaluate_polynomial_fma(x * x, sin_fit<Terms>(), Terms);
+    }
+
+    template <uint32_t Terms>
+    static double asin_kernel_mirror(double x) {
+        bool is_large = x > 0.5;
+        double reflected = (1.0 - x) * 0.5;
+        double t = is_large ? reflected : x * x;
+        double r = is_large ? sqrt(reflected) : x;
+        double a = r * evaluate_polynomial_fma(t, asin_fit<Terms>(), Terms);
+        return is_large ? fma(-2.0, a, HALF_PI64) : a;
+    }
+
+    template <uint32_t SinTerms = HAVERSINE_SIN_TERMS, uint32_t AsinTerms = HAVERSINE_ASIN_TERMS>
+    static double haversine_kernel_mirror(double x0, double y0, double x1, double y1) {
+        double half_radians_per_degree = 0.5 * 0.01745329251994329577;
+        double radians_per_degree = 0.01745329251994329577;
+        double half_dlat = fabs((y1 - y0) * half_radians_per_degree);
+        double half_dlon = fabs((x1 - x0) * half_radians_per_degree);
+        double folded = (PI64 - half_dlon) + PI64_LOW;
+        half_dlon = (half_dlon < folded) ? half_dlon : folded;
+        double lat0 = fabs(y0 * radians_per_degree);
+        double lat1 = fabs(y1 * radians_per_degree);
+
+        double sin_dlat = sin_kernel_mirror<SinTerms>(half_dlat);
+        double sin_dlon = sin_kernel_mirror<SinTerms>(half_dlon);
+        double cos_lat0 = sin_kernel_mirror<SinTerms>((HALF_PI64 - lat0) + HALF_PI64_LOW);
+        double cos_lat1 = sin_kernel_mirror<SinTerms>((HALF_PI64 - lat1) + HALF_PI64_LOW);
+
+        double a = (cos_lat0 * cos_lat1) * (sin_dlon * sin_dlon);
+        a = fma(sin_dlat, sin_dlat, a);
+        return (2.0 * EARTH_RADIUS) * asin_kernel_mirror<AsinTerms>(sqrt(a));
+    }
+
+    static double random_unit(uint64_t *state) {
+        *state ^= *state << 13;
+        *state ^= *state >> 7;
+        *state ^= *state << 17;
+        return (double)(*state >> 11) / (double)(1ull << 53);
+    }
+
+    // NOTE: a third each of random, nearby and near-antipodal pairs.
+    static void make_math_check_pairs(haversine_pairs_soa *pairs) {
+        uint64_t state = 0x9E3779B97F4A7C15ull;
+        for (uint64_t i = 0; i < MATH_CHECK_PAIR_COUNT; ++i) {
+            double x0 = 360.0 * random_unit(&state) - 180.0;
+            double y0 = 180.0 * random_unit(&state) - 90.0;
+            double x1 = 360.0 * random_unit(&state) - 180.0;
+            double y1 = 180.0 * random_unit(&state) - 90.0;
+            if (i % 3 == 1) {
+                x1 = x0 + 0.01 * (x1 / 180.0);
+                y1 = y0 + 0.01 * (y1 / 90.0);
+            } else if (i % 3 == 2) {
+                x1 = (x0 > 0 ? x0 - 180.0 : x0 + 180.0) + 0.01 * (x1 / 180.0);
+                y1 = -y0 + 0.01 * (y1 / 90.0);
+            }
+            pairs->x0[i] = x0;
+            pairs->y0[i] = y0;
+            pairs->x1[i] = x1;
+            pairs->y1[i] = y1;
+        }
+        pairs->count = MATH_CHECK_PAIR_COUNT;
+        pad_pairs_soa(pairs);
+    }
+
+    // NOTE: each pair is summed on its own, padded with zero pairs (whose
+    // distance is exactly zero), which gives the kernel's distance for it.
+    static void check_haversine_kernel(char const *name, haversine_sum_fn sum_distances, haversine_pairs_soa const &pairs) {
+        haversine_pairs_soa single = allocate_pairs_soa(HAVERSINE_LANE_PADDING);
+        if (!single.capacity) {
+            return;
+        }
+        uint64_t max_ulp_error = 0;
+        double max_ulp_error_distance = 0;
+        double max_relative_error = 0;
+        double max_tolerance_ratio = 0;
+        double distance_sum = 0;
+        double expected_sum = 0;
+        for (uint64_t i = 0; i < pairs.count; ++i) {
+            single.count = 0;
+            push_pair(&single, {pairs.x0[i], pairs.x1[i], pairs.y0[i], pairs.y1[i]});
+            pad_pairs_soa(&single);
+            double distance = sum_distances(&single, 0, single.count);
+            double mirrored = haversine_kernel_mirror(pairs.x0[i], pairs.y0[i], pairs.x1[i], pairs.y1[i]);
+            double expected = ReferenceHaversine(pairs.x0[i], pairs.y0[i], pairs.x1[i], pairs.y1[i], EARTH_RADIUS);
+            uint64_t ulp_error = ulp_distance(distance, mirrored);
+            if (ulp_error > max_ulp_error) {
+                max_ulp_error = ulp_error;
+                max_ulp_error_distance = expected;
+            }
+            double relative_error = expected ? fabs(distance - expected) / expected : fabs(distance);
+            if (relative_error > max_relative_error) {
+                max_relative_error = relative_error;
+            }
+            double tolerance_ratio = relative_error / haversine_kernel_tolerance(expected);
+            if (tolerance_ratio > max_tolerance_ratio) {
+                max_tolerance_ratio = tolerance_ratio;
+            }
+            distance_sum += distance;
+            expected_sum += expected;
+        }
+        double average_error = fabs(distance_sum - expected_sum) / expected_sum;
+        bool is_ok = !max_ulp_error && (max_tolerance_ratio <= 1.0) && (average_error <= HAVERSINE_AVERAGE_TOLERANCE);
+        free_pairs_soa(&single);
+
+        uint64_t best = UINT64_MAX;
+        for (uint32_t pass = 0; pass < MATH_CHECK_TIMING_PASSES; ++pass) {
+            uint64_t start = read_cpu_timer();
+            volatile double sum = sum_distances(&pairs, 0, pairs.count);
+            uint64_t elapsed = read_cpu_timer() - start;
+            (void)sum;
+            if (elapsed < best) {
+                best = elapsed;
+            }
+        }
+        printf("%-10s %14llu %22.17g %12.3e %12.3f %12.3e %8s %12.2f\n", name, max_ulp_error, max_ulp_error_distance,
+               max_relative_error, max_tolerance_ratio, average_error, is_ok ? "ok" : "FAILED", (double)best / pairs.count);
+    }
+
+    static void check_haversine_kernels() {
+        haversine_pairs_soa pairs = allocate_pairs_soa(MATH_CHECK_PAIR_COUNT);
+        if (pairs.capacity) {
+            make_math_check_pairs(&pairs);
+            printf("\n--- haversine kernels (%llu pairs; ulp vs the kernel mirror, rel error vs ReferenceHaversine) ---\n",
+                   MATH_CHECK_PAIR_COUNT);
+            printf("%-10s %14s %22s %12s %12s %12s %8s %12s\n", "kernel", "max ulp", "at distance", "max rel", "rel/tol",
+                   "average rel", "", "cycles/pair");
+            if (is_isa_level_supported(eIsaLevel::Avx2)) {
+                check_haversine_kernel("avx2", sum_haversine_soa_avx2<>, pairs);
+            }
+            if (is_isa_level_supported(eIsaLevel::Avx512)) {
+                check_haversine_kernel("avx512", sum_haversine_soa_avx512<>, pairs);
+            }
+        }
+        free_pairs_soa(&pairs);
+    }
+
+    static void run_math_check() {
+        buffer memory = allocate_buffer(2 * MATH_CHECK_SAMPLE_COUNT * sizeof(double));
+        if (memory.data) {
+            math_check_samples samples = {};
+            samples.inputs = (double *)memory.data;
+            samples.reference = samples.inputs + MATH_CHECK_SAMPLE_COUNT;
+
+            printf("Default build: sin/cos %u terms, asin %u terms, hardware sqrt.\n", HAVERSINE_SIN_TERMS, HAVERSINE_ASIN_TERMS);
+
+            prepare_math_check(&samples, {"sin (half longitude delta)", -PI64, PI64}, [](double x) { return sin(x); });
+            check_sin_fits<HAVERSINE_SIN_MIN_TERMS>(samples);
+
+            prepare_math_check(&samples, {"cos (latitude)", -HALF_PI64, HALF_PI64}, [](double x) { return cos(x); });
+            check_cos_fits<HAVERSINE_SIN_MIN_TERMS>(samples);
+
+            prepare_math_check(&samples, {"asin", 0.0, 1.0}, [](double x) { return asin(x); });
+            check_asin_fits<HAVERSINE_ASIN_MIN_TERMS>(samples);
+
+            prepare_math_check(&samples, {"sqrt", 0.0, 1.0}, [](double x) { return sqrt(x); });
+            check_sqrt_steps<1>(samples);
+
+            check_haversine_kernels();
+        }
+        free_buffer(&memory);
+    }
+}
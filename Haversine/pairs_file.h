@@ -0,0 +1,158 @@
+#pragma once
+#include "buffer.h"
+#include "common.h"
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Binary pair files: the parsed pairs written out exactly as the kernels
+// want them, so a later run maps the file and sums it with no parse at all.
+// A 64-byte header is followed by the four float64 columns (x0, y0, x1, y1),
+// each padded with zero pairs to a multiple of HAVERSINE_LANE_PADDING like a
+// haversine_pairs_soa, so the mapping is used in place. Everything is stored
+// little-endian, as on the machines that write it.
+constexpr uint64_t HAVERSINE_PAIRS_MAGIC = 0x3153524941505648; // "HVPAIRS1"
+constexpr uint32_t HAVERSINE_PAIRS_VERSION = 1;
+
+enum class eHaversinePairsLayout : uint32_t {
+    SoaF64 = 1
+};
+
+struct haversine_pairs_header {
+    uint64_t magic;
+    uint32_t version;
+    eHaversinePairsLayout layout;
+    uint64_t count;
+    // NOTE: doubles per column, i.e. count padded to the lane width.
+    uint64_t column_stride;
+    // NOTE: from the start of the file; a multiple of HAVERSINE_COLUMN_ALIGNMENT.
+    uint64_t column_offset;
+    uint64_t checksum;
+    uint64_t reserved[2];
+};
+static_assert(sizeof(haversine_pairs_header) == HAVERSINE_COLUMN_ALIGNMENT, "header must keep the columns aligned");
+
+// NOTE: four interleaved FNV-1a style lanes over 64-bit words, so it runs at
+// memory speed instead of one multiply latency per word. Only meant to catch
+// truncated or damaged files, not tampering.
+uint64_t checksum_pair_columns(haversine_pairs_soa const* pairs, uint64_t column_stride)
+{
+    uint64_t const prime = 0x100000001b3ull;
+    uint64_t lanes[4] = { 0xcbf29ce484222325ull, 0x84222325cbf29ce4ull, 0x9ce484222325cbf2ull, 0x2325cbf29ce48422ull };
+    double const* columns[4] = { pairs->x0, pairs->y0, pairs->x1, pairs->y1 };
+    for (double const* column : columns) {
+        // NOTE: the stride is a multiple of the lane padding, so of four too.
+        for (uint64_t i = 0; i < column_stride; i += 4) {
+            for (uint32_t lane = 0; lane < 4; ++lane) {
+                uint64_t word = 0;
+                memcpy(&word, column + i + lane, sizeof(word));
+                lanes[lane] = (lanes[lane] ^ word) * prime;
+            }
+        }
+    }
+    uint64_t result = lanes[0];
+    for (uint32_t lane = 1; lane < 4; ++lane) {
+        result = (result ^ lanes[lane]) * prime;
+    }
+    return result;
+}
+
+// NOTE: `pairs` must have been padded with pad_pairs_soa.
+bool write_pairs_file(char const* filename, haversine_pairs_soa const* pairs)
+{
+    bool result = false;
+    haversine_pairs_header header = {};
+    header.magic = HAVERSINE_PAIRS_MAGIC;
+    header.version = HAVERSINE_PAIRS_VERSION;
+    header.layout = eHaversinePairsLayout::SoaF64;
+    header.count = pairs->count;
+    header.column_stride = pad_pair_count(pairs->count);
+    header.column_offset = sizeof(haversine_pairs_header);
+    header.checksum = checksum_pair_columns(pairs, header.column_stride);
+
+    FILE* file = fopen(filename, "wb");
+    if (file) {
+        result = (fwrite(&header, sizeof(header), 1, file) == 1);
+        double const* columns[4] = { pairs->x0, pairs->y0, pairs->x1, pairs->y1 };
+        for (double const* column : columns) {
+            if (result && header.column_stride) {
+                result = (fwrite(column, header.column_stride * sizeof(double), 1, file) == 1);
+            }
+        }
+        result = (fclose(file) == 0) && result;
+    }
+    if (!result) {
+        fprintf(stderr, "Error: unable to write `%s`.\n", filename);
+    }
+    return result;
+}
+
+bool is_pairs_file(char const* filename)
+{
+    bool result = false;
+    FILE* file = fopen(filename, "rb");
+    if (file) {
+        uint64_t magic = 0;
+        result = (fread(&magic, sizeof(magic), 1, file) == 1) && (magic == HAVERSINE_PAIRS_MAGIC);
+        fclose(file);
+    }
+    return result;
+}
+
+// Maps a pairs file and points `pairs` straight at its columns; nothing is
+// copied. The mapping is read-only and is released by free_pairs_soa.
+bool load_pairs_file(char const* filename, bool populate, haversine_pairs_soa* pairs)
+{
+    *pairs = {};
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) {
+        fprintf(stderr, "Error: unable to open `%s`.\n", filename);
+        return false;
+    }
+    struct stat s = {};
+    fstat(fd, &s);
+    buffer file = map_buffer(fd, s.st_size, populate);
+    close(fd);
+
+    char const* problem = nullptr;
+    haversine_pairs_header header = {};
+    if (file.count < sizeof(header)) {
+        problem = "too small for a header";
+    } else {
+        memcpy(&header, file.data, sizeof(header));
+        if (header.magic != HAVERSINE_PAIRS_MAGIC) {
+            problem = "not a pairs file";
+        } else if (header.version != HAVERSINE_PAIRS_VERSION) {
+            problem = "unsupported version";
+        } else if (header.layout != eHaversinePairsLayout::SoaF64) {
+            problem = "unsupported layout";
+        } else if ((header.column_stride != pad_pair_count(header.count))
+            || (header.column_offset % HAVERSINE_COLUMN_ALIGNMENT)
+            || (header.column_offset > file.count)
+            || ((file.count - header.column_offset) / (4 * sizeof(double)) < header.column_stride)) {
+            problem = "truncated or inconsistent";
+        } else {
+            double* columns = (double*)(file.data + header.column_offset);
+            pairs->count = header.count;
+            pairs->capacity = header.column_stride;
+            pairs->committed = header.column_stride;
+            pairs->x0 = columns + 0 * header.column_stride;
+            pairs->y0 = columns + 1 * header.column_stride;
+            pairs->x1 = columns + 2 * header.column_stride;
+            pairs->y1 = columns + 3 * header.column_stride;
+            pairs->memory = file;
+            if (checksum_pair_columns(pairs, header.column_stride) != header.checksum) {
+                problem = "checksum mismatch";
+                *pairs = {};
+            }
+        }
+    }
+    if (problem) {
+        fprintf(stderr, "Error: `%s` - %s.\n", filename, problem);
+        free_buffer(&file);
+    }
+    return !problem;
+}
@@ -0,0 +1,237 @@
+#pragma once
+#include "platform_metrics.h"
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+namespace lsp {
+
+// Hardware counters read around each phase of a run (read, parse, sum), so a
+// slow phase can be told apart: a branchy tokenizer shows up as branch
+// misses, a memory-bound sum as LLC and dTLB misses at a low IPC. Counters
+// are opened once through perf_event_open, before the thread pool starts and
+// with `inherit` set, so the pool threads are counted too. They then run
+// freely, and a phase is the difference between two reads.
+//
+// NOTE: anything the kernel refuses (no PMU under a VM, perf_event_paranoid,
+// a seccomp filter) is left out of the report and the rest still works.
+// Page faults fall back to getrusage, so they and the time are always there.
+enum class ePerfCounter {
+    Instructions,
+    Cycles,
+    BranchMisses,
+    L1dMisses,
+    LlcMisses,
+    DtlbMisses,
+    PageFaults,
+    Count
+};
+
+constexpr uint32_t PERF_COUNTER_COUNT = (uint32_t)ePerfCounter::Count;
+constexpr uint32_t MAX_PERF_PHASES = 16;
+
+constexpr uint64_t perf_cache_config(uint64_t cache, uint64_t op, uint64_t result)
+{
+    return cache | (op << 8) | (result << 16);
+}
+
+struct perf_counter_desc {
+    char const* label;
+    uint32_t type;
+    uint64_t config;
+};
+
+perf_counter_desc const PERF_COUNTER_DESCS[PERF_COUNTER_COUNT] = {
+    { "instructions", PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS },
+    { "cycles", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES },
+    { "branch-miss", PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES },
+    { "L1d-miss", PERF_TYPE_HW_CACHE, perf_cache_config(PERF_COUNT_HW_CACHE_L1D, PERF_COUNT_HW_CACHE_OP_READ, PERF_COUNT_HW_CACHE_RESULT_MISS) },
+    { "LLC-miss", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES },
+    { "dTLB-miss", PERF_TYPE_HW_CACHE, perf_cache_config(PERF_COUNT_HW_CACHE_DTLB, PERF_COUNT_HW_CACHE_OP_READ, PERF_COUNT_HW_CACHE_RESULT_MISS) },
+    { "faults", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS },
+};
+
+struct perf_counters {
+    int fds[PERF_COUNTER_COUNT];
+    int errors[PERF_COUNTER_COUNT];
+    bool is_enabled;
+};
+
+struct perf_snapshot {
+    uint64_t tsc;
+    uint64_t values[PERF_COUNTER_COUNT];
+};
+
+struct perf_phase {
+    char const* label;
+    uint64_t hit_count;
+    uint64_t tsc;
+    uint64_t values[PERF_COUNTER_COUNT];
+};
+
+static perf_counters global_perf_counters;
+static perf_phase global_perf_phases[MAX_PERF_PHASES];
+static uint32_t global_perf_phase_count;
+
+// NOTE: call before any thread that should be counted is started.
+void open_perf_counters()
+{
+    perf_counters* counters = &global_perf_counters;
+    for (uint32_t i = 0; i < PERF_COUNTER_COUNT; ++i) {
+        perf_event_attr attr = {};
+        attr.size = sizeof(attr);
+        attr.type = PERF_COUNTER_DESCS[i].type;
+        attr.config = PERF_COUNTER_DESCS[i].config;
+        attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+        attr.inherit = 1;
+        // NOTE: user space only, which is all perf_event_paranoid=2 allows.
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        counters->fds[i] = (int)syscall(__NR_perf_event_open, &attr, 0, -1, -1, PERF_FLAG_FD_CLOEXEC);
+        counters->errors[i] = (counters->fds[i] < 0) ? errno : 0;
+    }
+    counters->is_enabled = true;
+}
+
+void close_perf_counters()
+{
+    perf_counters* counters = &global_perf_counters;
+    if (counters->is_enabled) {
+        for (uint32_t i = 0; i < PERF_COUNTER_COUNT; ++i) {
+            if (counters->fds[i] >= 0) {
+                close(counters->fds[i]);
+            }
+        }
+    }
+    *counters = {};
+}
+
+// NOTE: with more counters than the PMU has registers the kernel time-slices
+// them, so each value is scaled up by the share of time it was counting.
+perf_snapshot read_perf_counters()
+{
+    perf_counters* counters = &global_perf_counters;
+    perf_snapshot result = {};
+    for (uint32_t i = 0; i < PERF_COUNTER_COUNT; ++i) {
+        uint64_t data[3] = {};
+        if ((counters->fds[i] >= 0) && (read(counters->fds[i], data, sizeof(data)) == sizeof(data)) && data[2]) {
+            result.values[i] = (uint64_t)((double)data[0] * (double)data[1] / (double)data[2]);
+        }
+    }
+    if (counters->fds[(uint32_t)ePerfCounter::PageFaults] < 0) {
+        result.values[(uint32_t)ePerfCounter::PageFaults] = read_os_page_fault_count();
+    }
+    result.tsc = read_cpu_timer();
+    return result;
+}
+
+perf_phase* get_perf_phase(char const* label)
+{
+    for (uint32_t i = 0; i < global_perf_phase_count; ++i) {
+        if (strcmp(global_perf_phases[i].label, label) == 0) {
+            return global_perf_phases + i;
+        }
+    }
+    perf_phase* result = nullptr;
+    if (global_perf_phase_count < MAX_PERF_PHASES) {
+        result = global_perf_phases + global_perf_phase_count++;
+        result->label = label;
+    }
+    return result;
+}
+
+// Adds everything counted while it is alive to the phase named `label`.
+// Costs nothing unless the counters were opened.
+struct perf_phase_block {
+    perf_phase_block(char const* label)
+    {
+        this->label = label;
+        if (global_perf_counters.is_enabled) {
+            start = read_perf_counters();
+        }
+    }
+
+    ~perf_phase_block()
+    {
+        if (global_perf_counters.is_enabled) {
+            perf_snapshot end = read_perf_counters();
+            perf_phase* phase = get_perf_phase(label);
+            if (phase) {
+                ++phase->hit_count;
+                phase->tsc += end.tsc - start.tsc;
+                for (uint32_t i = 0; i < PERF_COUNTER_COUNT; ++i) {
+                    phase->values[i] += end.values[i] - start.values[i];
+                }
+            }
+        }
+    }
+
+    char const* label;
+    perf_snapshot start;
+};
+
+#define PERF_PHASE_CONCAT2(a, b) a##b
+#define PERF_PHASE_CONCAT(a, b) PERF_PHASE_CONCAT2(a, b)
+#define PERF_PHASE(label) lsp::perf_phase_block PERF_PHASE_CONCAT(perf_phase, __LINE__)(label)
+
+void print_perf_phases(uint64_t timer_freq)
+{
+    perf_counters* counters = &global_perf_counters;
+    if (!counters->is_enabled) {
+        return;
+    }
+
+    bool is_available[PERF_COUNTER_COUNT] = {};
+    bool has_missing = false;
+    for (uint32_t i = 0; i < PERF_COUNTER_COUNT; ++i) {
+        is_available[i] = (counters->fds[i] >= 0) || (i == (uint32_t)ePerfCounter::PageFaults);
+        has_missing |= !is_available[i];
+    }
+    uint32_t const instructions = (uint32_t)ePerfCounter::Instructions;
+    uint32_t const cycles = (uint32_t)ePerfCounter::Cycles;
+    bool has_ipc = is_available[instructions] && is_available[cycles];
+
+    printf("\nCounters:\n");
+    printf("  %-10s %5s %10s", "phase", "hits", "ms");
+    for (uint32_t i = 0; i < PERF_COUNTER_COUNT; ++i) {
+        if (is_available[i]) {
+            printf(" %14s", PERF_COUNTER_DESCS[i].label);
+        }
+    }
+    printf(has_ipc ? " %6s\n" : "\n", "IPC");
+
+    for (uint32_t phase_index = 0; phase_index < global_perf_phase_count; ++phase_index) {
+        perf_phase* phase = global_perf_phases + phase_index;
+        double ms = timer_freq ? (1000.0 * (double)phase->tsc / (double)timer_freq) : 0;
+        printf("  %-10s %5llu %10.3f", phase->label, phase->hit_count, ms);
+        for (uint32_t i = 0; i < PERF_COUNTER_COUNT; ++i) {
+            if (is_available[i]) {
+                printf(" %14llu", phase->values[i]);
+            }
+        }
+        if (has_ipc) {
+            double ipc = phase->values[cycles] ? ((double)phase->values[instructions] / (double)phase->values[cycles]) : 0;
+            printf(" %6.2f", ipc);
+        }
+        printf("\n");
+    }
+
+    if (has_missing) {
+        printf("  Unavailable:");
+        for (uint32_t i = 0; i < PERF_COUNTER_COUNT; ++i) {
+            if (!is_available[i]) {
+                printf(" %s (%s)", PERF_COUNTER_DESCS[i].label, strerror(counters->errors[i]));
+            }
+        }
+        printf("\n");
+    }
+    if (counters->fds[(uint32_t)ePerfCounter::PageFaults] < 0) {
+        printf("  Page faults are from getrusage.\n");
+    }
+}
+
+} // namespace lsp
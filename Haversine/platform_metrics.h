@@ -0,0 +1,70 @@
+#pragma once
+#include <cstdint>
+#include <ctime>
+#include <sys/resource.h>
+#include <x86intrin.h>
+
+namespace lsp {
+
+uint64_t get_os_timer_freq()
+{
+    return 1000000000ull;
+}
+
+uint64_t read_os_timer()
+{
+    timespec value = {};
+    clock_gettime(CLOCK_MONOTONIC_RAW, &value);
+    uint64_t result = get_os_timer_freq() * (uint64_t)value.tv_sec + (uint64_t)value.tv_nsec;
+    return result;
+}
+
+uint64_t read_cpu_timer()
+{
+    return __rdtsc();
+}
+
+// NOTE: RDTSC ticks at a fixed rate that the OS does not report, so it is
+// measured against the monotonic clock over a short busy wait.
+uint64_t estimate_cpu_timer_freq(uint64_t milliseconds_to_wait = 100)
+{
+    uint64_t os_freq = get_os_timer_freq();
+    uint64_t cpu_start = read_cpu_timer();
+    uint64_t os_start = read_os_timer();
+    uint64_t os_end = 0;
+    uint64_t os_elapsed = 0;
+    uint64_t os_wait_time = os_freq * milliseconds_to_wait / 1000;
+    while (os_elapsed < os_wait_time) {
+        os_end = read_os_timer();
+        os_elapsed = os_end - os_start;
+    }
+
+    uint64_t cpu_end = read_cpu_timer();
+    uint64_t cpu_elapsed = cpu_end - cpu_start;
+
+    uint64_t cpu_freq = 0;
+    if (os_elapsed) {
+        cpu_freq = os_freq * cpu_elapsed / os_elapsed;
+    }
+    return cpu_freq;
+}
+
+uint64_t read_os_page_fault_count()
+{
+    rusage usage = {};
+    getrusage(RUSAGE_SELF, &usage);
+    uint64_t result = (uint64_t)usage.ru_minflt + (uint64_t)usage.ru_majflt;
+    return result;
+}
+
+// NOTE: only the calling thread's faults, so other threads' work does not
+// get mixed into a measurement.
+uint64_t read_thread_page_fault_count()
+{
+    rusage usage = {};
+    getrusage(RUSAGE_THREAD, &usage);
+    uint64_t result = (uint64_t)usage.ru_minflt + (uint64_t)usage.ru_majflt;
+    return result;
+}
+
+} // namespace lsp
@@ -0,0 +1,159 @@
+#pragma once
+#include "perf_counters.h"
+#include "platform_metrics.h"
+#include <cstdint>
+#include <cstdio>
+
+// Compile with HAVERSINE_PROFILE=1 to get per-zone timings. With it off every
+// zone macro expands to nothing and only the total run time is reported.
+#ifndef HAVERSINE_PROFILE
+#define HAVERSINE_PROFILE 0
+#endif
+
+namespace lsp {
+
+#if HAVERSINE_PROFILE
+
+struct profile_anchor {
+    uint64_t elapsed_exclusive; // NOTE: does NOT include children
+    uint64_t elapsed_inclusive; // NOTE: DOES include children
+    uint64_t hit_count;
+    uint64_t processed_byte_count;
+    char const* label;
+};
+
+constexpr uint32_t MAX_PROFILE_ANCHORS = 4096;
+static profile_anchor global_profile_anchors[MAX_PROFILE_ANCHORS];
+static uint32_t global_profiler_parent;
+
+struct profile_block {
+    profile_block(char const* label, uint32_t anchor_index, uint64_t byte_count)
+    {
+        parent_index = global_profiler_parent;
+
+        this->anchor_index = anchor_index;
+        this->label = label;
+
+        profile_anchor* anchor = global_profile_anchors + anchor_index;
+        // NOTE: a recursive entry into the same zone must not count its time
+        // twice, so the outermost inclusive value is restored on exit.
+        old_elapsed_inclusive = anchor->elapsed_inclusive;
+        anchor->processed_byte_count += byte_count;
+
+        global_profiler_parent = anchor_index;
+        start_tsc = read_cpu_timer();
+    }
+
+    ~profile_block()
+    {
+        uint64_t elapsed = read_cpu_timer() - start_tsc;
+        global_profiler_parent = parent_index;
+
+        profile_anchor* parent = global_profile_anchors + parent_index;
+        profile_anchor* anchor = global_profile_anchors + anchor_index;
+
+        parent->elapsed_exclusive -= elapsed;
+        anchor->elapsed_exclusive += elapsed;
+        anchor->elapsed_inclusive = old_elapsed_inclusive + elapsed;
+        ++anchor->hit_count;
+
+        anchor->label = label;
+    }
+
+    char const* label;
+    uint64_t old_elapsed_inclusive;
+    uint64_t start_tsc;
+    uint32_t parent_index;
+    uint32_t anchor_index;
+};
+
+#define PROFILE_NAME_CONCAT2(a, b) a##b
+#define PROFILE_NAME_CONCAT(a, b) PROFILE_NAME_CONCAT2(a, b)
+#define TIME_BANDWIDTH(name, byte_count) \
+    lsp::profile_block PROFILE_NAME_CONCAT(block, __LINE__)(name, __COUNTER__ + 1, byte_count)
+#define PROFILER_END_OF_COMPILATION_UNIT \
+    static_assert(__COUNTER__ < lsp::MAX_PROFILE_ANCHORS, "Number of profile points exceeds size of profiler anchor array")
+
+void print_time_elapsed(uint64_t total_tsc_elapsed, uint64_t timer_freq, profile_anchor* anchor)
+{
+    double percent = 100.0 * ((double)anchor->elapsed_exclusive / (double)total_tsc_elapsed);
+    printf("  %s[%llu]: %llu (%.2f%%", anchor->label, anchor->hit_count, anchor->elapsed_exclusive, percent);
+    if (anchor->elapsed_inclusive != anchor->elapsed_exclusive) {
+        double percent_with_children = 100.0 * ((double)anchor->elapsed_inclusive / (double)total_tsc_elapsed);
+        printf(", %.2f%% w/children", percent_with_children);
+    }
+    printf(")");
+
+    if (anchor->processed_byte_count) {
+        double megabyte = 1024.0 * 1024.0;
+        double gigabyte = megabyte * 1024.0;
+
+        double seconds = (double)anchor->elapsed_inclusive / (double)timer_freq;
+        double bytes_per_second = (double)anchor->processed_byte_count / seconds;
+        double megabytes = (double)anchor->processed_byte_count / megabyte;
+        double gigabytes_per_second = bytes_per_second / gigabyte;
+
+        printf("  %.3fmb at %.2fgb/s", megabytes, gigabytes_per_second);
+    }
+    printf("\n");
+}
+
+void print_anchor_data(uint64_t total_cpu_elapsed, uint64_t timer_freq)
+{
+    for (uint32_t anchor_index = 0; anchor_index < MAX_PROFILE_ANCHORS; ++anchor_index) {
+        profile_anchor* anchor = global_profile_anchors + anchor_index;
+        if (anchor->elapsed_inclusive) {
+            print_time_elapsed(total_cpu_elapsed, timer_freq, anchor);
+        }
+    }
+}
+
+#else
+
+#define TIME_BANDWIDTH(...)
+#define PROFILER_END_OF_COMPILATION_UNIT
+
+void print_anchor_data(uint64_t, uint64_t)
+{
+}
+
+#endif
+
+#define TIME_BLOCK(name) TIME_BANDWIDTH(name, 0)
+#define TIME_FUNCTION TIME_BLOCK(__func__)
+
+// NOTE: the run is timed on both clocks, so the run itself calibrates the
+// CPU timer and no estimate_cpu_timer_freq busy wait is added to it.
+struct profiler {
+    uint64_t start_tsc;
+    uint64_t end_tsc;
+    uint64_t start_os;
+    uint64_t end_os;
+};
+static profiler global_profiler;
+
+void begin_profile()
+{
+    global_profiler.start_os = read_os_timer();
+    global_profiler.start_tsc = read_cpu_timer();
+}
+
+void end_and_print_profile()
+{
+    global_profiler.end_tsc = read_cpu_timer();
+    global_profiler.end_os = read_os_timer();
+
+    uint64_t total_cpu_elapsed = global_profiler.end_tsc - global_profiler.start_tsc;
+    uint64_t total_os_elapsed = global_profiler.end_os - global_profiler.start_os;
+    uint64_t cpu_freq = 0;
+    if (total_os_elapsed) {
+        cpu_freq = (uint64_t)((double)get_os_timer_freq() * (double)total_cpu_elapsed / (double)total_os_elapsed);
+    }
+
+    printf("\nTotal time: %0.4fms (CPU freq %llu)\n", 1000.0 * (double)total_os_elapsed / (double)get_os_timer_freq(), cpu_freq);
+
+    print_anchor_data(total_cpu_elapsed, cpu_freq);
+    print_perf_phases(cpu_freq);
+}
+
+} // namespace lsp
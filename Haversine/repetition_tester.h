@@ -0,0 +1,185 @@
+#pragma once
+#include "platform_metrics.h"
+#include <cstdint>
+#include <cstdio>
+
+namespace lsp {
+
+enum class eTestMode {
+    Uninitialized,
+    Testing,
+    Completed,
+    Error
+};
+
+struct repetition_test_results {
+    uint64_t test_count;
+    uint64_t total_time;
+    uint64_t max_time;
+    uint64_t min_time;
+};
+
+// A test wave repeatedly times one operation between begin_time/end_time and
+// keeps going until no new minimum has been observed for `try_for_time`.
+// The minimum is the number we care about: it is the run least disturbed by
+// the OS, the caches and the frequency governor.
+struct repetition_tester {
+    uint64_t target_processed_byte_count;
+    uint64_t cpu_timer_freq;
+    uint64_t try_for_time;
+    uint64_t tests_started_at;
+
+    eTestMode mode;
+    bool print_new_minimums;
+    uint32_t open_block_count;
+    uint32_t close_block_count;
+    uint64_t time_accumulated_on_this_test;
+    uint64_t bytes_accumulated_on_this_test;
+
+    repetition_test_results results;
+};
+
+double seconds_from_cpu_time(double cpu_time, uint64_t cpu_timer_freq)
+{
+    double result = 0.0;
+    if (cpu_timer_freq) {
+        result = cpu_time / (double)cpu_timer_freq;
+    }
+    return result;
+}
+
+void print_time(char const* label, double cpu_time, uint64_t cpu_timer_freq, uint64_t byte_count)
+{
+    printf("%s: %.0f", label, cpu_time);
+    if (cpu_timer_freq) {
+        double seconds = seconds_from_cpu_time(cpu_time, cpu_timer_freq);
+        printf(" (%fms)", 1000.0 * seconds);
+
+        if (byte_count && seconds > 0.0) {
+            double gigabyte = (1024.0 * 1024.0 * 1024.0);
+            double bandwidth = (double)byte_count / (gigabyte * seconds);
+            printf(" %fgb/s", bandwidth);
+        }
+    }
+}
+
+void print_results(repetition_test_results results, uint64_t cpu_timer_freq, uint64_t byte_count)
+{
+    print_time("Min", (double)results.min_time, cpu_timer_freq, byte_count);
+    printf("\n");
+
+    print_time("Max", (double)results.max_time, cpu_timer_freq, byte_count);
+    printf("\n");
+
+    if (results.test_count) {
+        print_time("Avg", (double)results.total_time / (double)results.test_count, cpu_timer_freq, byte_count);
+        printf("\n");
+    }
+}
+
+void error(repetition_tester* tester, char const* message)
+{
+    tester->mode = eTestMode::Error;
+    fprintf(stderr, "ERROR: %s\n", message);
+}
+
+void new_test_wave(repetition_tester* tester, uint64_t target_processed_byte_count,
+    uint64_t cpu_timer_freq, uint32_t seconds_to_try = 10)
+{
+    if (tester->mode == eTestMode::Uninitialized) {
+        tester->mode = eTestMode::Testing;
+        tester->target_processed_byte_count = target_processed_byte_count;
+        tester->cpu_timer_freq = cpu_timer_freq;
+        tester->print_new_minimums = true;
+        tester->results.min_time = (uint64_t)-1;
+    } else if (tester->mode == eTestMode::Completed) {
+        tester->mode = eTestMode::Testing;
+
+        if (tester->target_processed_byte_count != target_processed_byte_count) {
+            error(tester, "target_processed_byte_count changed");
+        }
+
+        if (tester->cpu_timer_freq != cpu_timer_freq) {
+            error(tester, "CPU frequency changed");
+        }
+    }
+
+    tester->try_for_time = seconds_to_try * cpu_timer_freq;
+    tester->tests_started_at = read_cpu_timer();
+}
+
+void begin_time(repetition_tester* tester)
+{
+    ++tester->open_block_count;
+    tester->time_accumulated_on_this_test -= read_cpu_timer();
+}
+
+void end_time(repetition_tester* tester)
+{
+    ++tester->close_block_count;
+    tester->time_accumulated_on_this_test += read_cpu_timer();
+}
+
+void count_bytes(repetition_tester* tester, uint64_t byte_count)
+{
+    tester->bytes_accumulated_on_this_test += byte_count;
+}
+
+bool is_testing(repetition_tester* tester)
+{
+    if (tester->mode == eTestMode::Testing) {
+        uint64_t current_time = read_cpu_timer();
+
+        // NOTE: the first call of a wave has no test to close yet.
+        if (tester->open_block_count) {
+            if (tester->open_block_count != tester->close_block_count) {
+                error(tester, "Unbalanced begin_time/end_time");
+            }
+
+            if (tester->bytes_accumulated_on_this_test != tester->target_processed_byte_count) {
+                error(tester, "Processed byte count mismatch");
+            }
+
+            if (tester->mode == eTestMode::Testing) {
+                repetition_test_results* results = &tester->results;
+                uint64_t elapsed_time = tester->time_accumulated_on_this_test;
+                results->test_count += 1;
+                results->total_time += elapsed_time;
+                if (results->max_time < elapsed_time) {
+                    results->max_time = elapsed_time;
+                }
+
+                if (results->min_time > elapsed_time) {
+                    results->min_time = elapsed_time;
+
+                    // NOTE: any new minimum restarts the clock for the whole wave.
+                    tester->tests_started_at = current_time;
+
+                    if (tester->print_new_minimums) {
+                        print_time("Min", (double)results->min_time, tester->cpu_timer_freq,
+                            tester->bytes_accumulated_on_this_test);
+                        printf("               \r");
+                        fflush(stdout);
+                    }
+                }
+
+                tester->open_block_count = 0;
+                tester->close_block_count = 0;
+                tester->time_accumulated_on_this_test = 0;
+                tester->bytes_accumulated_on_this_test = 0;
+            }
+        }
+
+        if ((current_time - tester->tests_started_at) > tester->try_for_time) {
+            tester->mode = eTestMode::Completed;
+
+            printf("                                                          \r");
+            print_results(tester->results, tester->cpu_timer_freq, tester->target_processed_byte_count);
+        }
+    }
+
+    bool result = (tester->mode == eTestMode::Testing);
+    return result;
+}
+
+} // namespace lsp
@@ -0,0 +1,100 @@
+#pragma once
+#include "common.h"
+#include "file_stream.h"
+#include "haversine_math.h"
+#include <cstdint>
+
+namespace lsp {
+
+    // Output sink that sums pairs as they are parsed instead of keeping them:
+    // pairs collect in a fixed-size SoA window, and every time it fills up it
+    // is summed on the pool and emptied. Together with a file_stream, memory
+    // stays at the cap whatever the size of the input. A fused window is a
+    // single sum block, small enough to stay in L1, that the parsing thread
+    // sums itself as soon as it fills, so the pairs never make it to memory.
+    //
+    // NOTE: the window holds a whole number of sum blocks, so the blocks are
+    // the same as with all pairs in memory, and their sums are merged with a
+    // pairwise_accumulator. The total therefore does not depend on the cap or
+    // the thread count; it may still differ from sum_haversine_blocks in the
+    // last bits, since that reduces all the block sums as one tree.
+    constexpr uint64_t DEFAULT_MEMORY_CAP = 64ull * 1024 * 1024;
+
+    struct haversine_sum_window {
+        thread_pool *pool;
+        haversine_sum_fn sum_distances;
+        haversine_pairs_soa pairs;
+        buffer block_sums;
+        pairwise_accumulator total;
+        uint64_t pair_count;
+    };
+
+    // NOTE: what is left of the cap after the stream buffers goes to the
+    // window, at four doubles per pair plus a block sum per block.
+    static uint64_t get_window_pair_count(uint64_t memory_cap) {
+        uint64_t stream_bytes = STREAM_SLOT_COUNT * (STREAM_CARRY_SIZE + STREAM_CHUNK_SIZE);
+        uint64_t block_bytes = HAVERSINE_SUM_BLOCK_PAIRS * 4 * sizeof(double) + sizeof(double);
+        uint64_t block_count = (memory_cap > stream_bytes) ? (memory_cap - stream_bytes) / block_bytes : 0;
+        if (!block_count) {
+            block_count = 1;
+        }
+        return block_count * HAVERSINE_SUM_BLOCK_PAIRS;
+    }
+
+    static haversine_sum_window make_sum_window(thread_pool *pool, uint64_t memory_cap, haversine_sum_fn sum_distances = global_haversine_sum) {
+        haversine_sum_window result = {};
+        uint64_t pair_count = get_window_pair_count(memory_cap);
+        result.pool = pool;
+        result.sum_distances = sum_distances;
+        result.pairs = allocate_pairs_soa(pair_count);
+        result.block_sums = allocate_buffer(get_sum_block_count(pair_count) * sizeof(double));
+        if (!result.block_sums.data) {
+            free_pairs_soa(&result.pairs);
+        }
+        return result;
+    }
+
+    // NOTE: one block is 32KB of columns.
+    static haversine_sum_window make_fused_sum_window(haversine_sum_fn sum_distances = global_haversine_sum) {
+        haversine_sum_window result = {};
+        result.sum_distances = sum_distances;
+        result.pairs = allocate_pairs_soa(HAVERSINE_SUM_BLOCK_PAIRS);
+        return result;
+    }
+
+    static void free_sum_window(haversine_sum_window *window) {
+        free_pairs_soa(&window->pairs);
+        free_buffer(&window->block_sums);
+    }
+
+    static void flush_sum_window(haversine_sum_window *window) {
+        if (window->pairs.count) {
+            pad_pairs_soa(&window->pairs);
+            if (window->pool) {
+                double *block_sums = (double *)window->block_sums.data;
+                sum_haversine_block_sums(window->pool, &window->pairs, window->sum_distances, block_sums);
+                uint64_t block_count = get_sum_block_count(window->pairs.count);
+                for (uint64_t i = 0; i < block_count; ++i) {
+                    accumulate_pairwise(&window->total, block_sums[i]);
+                }
+            } else {
+                accumulate_pairwise(&window->total, window->sum_distances(&window->pairs, 0, window->pairs.count));
+            }
+            window->pair_count += window->pairs.count;
+            window->pairs.count = 0;
+        }
+    }
+
+    static void push_pair(haversine_sum_window *window, haversine_pair const &pair) {
+        if (window->pairs.count == window->pairs.capacity) {
+            flush_sum_window(window);
+        }
+        push_pair(&window->pairs, pair);
+    }
+
+    // Returns the sum of the distances (not the average) once all pairs are in.
+    static double finish_sum_window(haversine_sum_window *window) {
+        flush_sum_window(window);
+        return finish_pairwise(&window->total);
+    }
+}
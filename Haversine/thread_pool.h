@@ -0,0 +1,124 @@
+#pragma once
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace lsp {
+
+// A fixed set of worker threads that run batches of indexed tasks. The
+// calling thread works on the batch too, so a pool of one thread has no
+// workers at all and runs everything inline. Tasks are handed out in index
+// order from a shared counter; which thread runs which task is not fixed, so
+// tasks must write their results to per-task slots.
+typedef void (*thread_task_fn)(void* context, uint64_t task_index);
+
+struct thread_pool {
+    std::vector<std::thread> workers;
+    std::mutex mutex;
+    std::condition_variable wake;
+    std::condition_variable finished;
+    uint64_t generation;
+    uint32_t busy_workers;
+    bool is_stopping;
+
+    thread_task_fn task;
+    void* context;
+    uint64_t task_count;
+    std::atomic<uint64_t> next_task;
+};
+
+uint32_t get_thread_count(thread_pool* pool)
+{
+    return (uint32_t)pool->workers.size() + 1;
+}
+
+void run_pending_tasks(thread_pool* pool)
+{
+    for (;;) {
+        uint64_t task_index = pool->next_task.fetch_add(1, std::memory_order_relaxed);
+        if (task_index >= pool->task_count) {
+            break;
+        }
+        pool->task(pool->context, task_index);
+    }
+}
+
+void run_worker(thread_pool* pool)
+{
+    uint64_t seen_generation = 0;
+    for (;;) {
+        {
+            std::unique_lock<std::mutex> lock(pool->mutex);
+            pool->wake.wait(lock, [&] { return pool->is_stopping || (pool->generation != seen_generation); });
+            if (pool->is_stopping) {
+                break;
+            }
+            seen_generation = pool->generation;
+        }
+
+        run_pending_tasks(pool);
+
+        std::lock_guard<std::mutex> lock(pool->mutex);
+        if (--pool->busy_workers == 0) {
+            pool->finished.notify_one();
+        }
+    }
+}
+
+void start_thread_pool(thread_pool* pool, uint32_t thread_count)
+{
+    pool->generation = 0;
+    pool->busy_workers = 0;
+    pool->is_stopping = false;
+    pool->task_count = 0;
+    pool->next_task = 0;
+    for (uint32_t i = 1; i < thread_count; ++i) {
+        pool->workers.emplace_back(run_worker, pool);
+    }
+}
+
+// Runs task(context, i) for every i in [0, task_count) and returns once all
+// of them are done.
+void run_tasks(thread_pool* pool, uint64_t task_count, thread_task_fn task, void* context)
+{
+    if (pool->workers.empty()) {
+        for (uint64_t i = 0; i < task_count; ++i) {
+            task(context, i);
+        }
+        return;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(pool->mutex);
+        pool->task = task;
+        pool->context = context;
+        pool->task_count = task_count;
+        pool->next_task.store(0, std::memory_order_relaxed);
+        pool->busy_workers = (uint32_t)pool->workers.size();
+        ++pool->generation;
+    }
+    pool->wake.notify_all();
+
+    run_pending_tasks(pool);
+
+    std::unique_lock<std::mutex> lock(pool->mutex);
+    pool->finished.wait(lock, [&] { return pool->busy_workers == 0; });
+}
+
+void stop_thread_pool(thread_pool* pool)
+{
+    {
+        std::lock_guard<std::mutex> lock(pool->mutex);
+        pool->is_stopping = true;
+    }
+    pool->wake.notify_all();
+    for (std::thread& worker : pool->workers) {
+        worker.join();
+    }
+    pool->workers.clear();
+}
+
+} // namespace lsp
@@ -1,11 +1,16 @@
 #include <iostream>
 #include <getopt.h>
+#include <cctype>
+#include <cerrno>
+#include <charconv>
+#include <algorithm>
 #include <cstring>
-#include <random>
-#include <array>
-#include <fstream>
 #include <cmath>
-#include <iomanip>
+#include <fcntl.h>
+#include <string>
+#include <thread>
+#include <unistd.h>
+#include <vector>
 
 enum class eOperatingMode {
   Null,
@@ -35,42 +40,164 @@ eOperatingMode get_op_mode(std::string op_mode) {
   throw std::invalid_argument("Operating mode can be only one of these two: [normal, cluster]");
 }
 
+// Where the points come from. Default is uniform for normal mode and the
+// boxes for cluster mode, as before the distributions could be picked.
+enum class eDistribution {
+  Default,
+  Uniform,
+  Boxes,
+  Hotspots,
+  Trips
+};
+
+eDistribution get_distribution(const std::string &name) {
+  if (name == "uniform") return eDistribution::Uniform;
+  if (name == "boxes") return eDistribution::Boxes;
+  if (name == "hotspots") return eDistribution::Hotspots;
+  if (name == "trips") return eDistribution::Trips;
+  throw std::invalid_argument("Distribution can be only one of these: [uniform, boxes, hotspots, trips]");
+}
+
+const char *distribution_to_str(eDistribution distribution) {
+  switch (distribution) {
+  case eDistribution::Uniform: return "uniform";
+  case eDistribution::Boxes: return "boxes";
+  case eDistribution::Hotspots: return "hotspots";
+  case eDistribution::Trips: return "trips";
+  default: return "default";
+  }
+}
+
+// Workload profiles: how the same pairs are spelled out, for measuring what
+// the input's shape costs the tokenizer and the float parser.
+enum class eNumberStyle {
+  Shortest,        // 12.5
+  Long,            // 17 significant digits: 12.500000000000000
+  Scientific,      // 1.25e+01
+  UpperScientific, // 1.25E+01
+  Mixed            // one of the above, per number
+};
+
+enum class eSpacing {
+  Lines,  // one pair per line, as the generator always wrote
+  Tight,  // no whitespace at all
+  Pretty, // one field per line, indented
+  Random  // random runs of whitespace between all tokens
+};
+
+struct Profile {
+  const char *name;
+  eNumberStyle numbers;
+  eSpacing spacing;
+  bool shuffle_keys;
+  int extra_fields; // unknown fields per pair, up to MAX_EXTRA_FIELDS
+  int nesting;      // depth of the nested object among the extra fields
+};
+
+static const Profile profiles[] = {
+  {"default", eNumberStyle::Shortest, eSpacing::Lines, false, 0, 0},
+  {"compact", eNumberStyle::Shortest, eSpacing::Tight, false, 0, 0},
+  {"pretty", eNumberStyle::Shortest, eSpacing::Pretty, false, 0, 0},
+  {"long", eNumberStyle::Long, eSpacing::Lines, false, 0, 0},
+  {"scientific", eNumberStyle::Scientific, eSpacing::Lines, false, 0, 0},
+  {"shuffled", eNumberStyle::Shortest, eSpacing::Lines, true, 0, 0},
+  {"fields", eNumberStyle::Shortest, eSpacing::Lines, false, 8, 1},
+  {"deep", eNumberStyle::Shortest, eSpacing::Tight, false, 2, 32},
+  {"messy", eNumberStyle::Mixed, eSpacing::Random, true, 4, 3},
+};
+
+const Profile *get_profile(const std::string &name) {
+  std::string names;
+  for (const auto &profile : profiles) {
+    if (name == profile.name)
+      return &profile;
+    names += names.empty() ? "" : ", ";
+    names += profile.name;
+  }
+  throw std::invalid_argument("Profile can be only one of these: [" + names + "]");
+}
+
 struct Config {
-  int n_pairs_to_generate = 1000;
+  uint64_t n_pairs_to_generate = 1000;
   unsigned long seed = 0;
   eOperatingMode mode = eOperatingMode::Null;
+  int n_threads = std::max(1u, std::thread::hardware_concurrency());
+  eDistribution distribution = eDistribution::Default;
+  const Profile *profile = &profiles[0];
+  // "-" writes the JSON to stdout; a named pipe works like any other path.
+  std::string output_path;
+  std::string answers_path;
 };
 
+// NOTE: when the JSON goes to stdout, everything else goes to stderr.
+std::ostream &log_stream(const Config &config) {
+  return (config.output_path == "-") ? std::cerr : std::cout;
+}
+
 std::ostream &operator<<(std::ostream &os, const Config &config) {
   return os << "n_pairs: " << config.n_pairs_to_generate
 	    << ", seed: " << config.seed
-            << ", mode: " << opmode_to_str(config.mode);
+            << ", mode: " << opmode_to_str(config.mode)
+            << ", distribution: " << distribution_to_str(config.distribution)
+            << ", profile: " << config.profile->name
+            << ", threads: " << config.n_threads
+            << ", output: " << config.output_path;
+}
+
+// Accepts plain integers as well as the 1e9 style, exactly up to 2^64 - 1.
+// NOTE: stoull would wrap a leading '-' around and stold reads hex, inf and
+// nan, so only digits and the decimal and exponent characters get that far.
+uint64_t parse_pair_count(const std::string &text) {
+  if (text.empty() || !isdigit((unsigned char)text[0]) ||
+      text.find_first_not_of("0123456789.eE+") != std::string::npos)
+    throw std::invalid_argument("invalid pair count: " + text);
+  size_t used = 0;
+  uint64_t result = std::stoull(text, &used);
+  if (used != text.size()) {
+    const long double value = std::stold(text, &used);
+    if (used != text.size() || value < 0 || value >= 0x1p64L)
+      throw std::invalid_argument("invalid pair count: " + text);
+    result = (uint64_t)value;
+  }
+  return result;
 }
 
 Config parse_command_line(int argc, char **argv) {
   if (argc < 1)
     throw std::invalid_argument("usage: "
 				+ std::string(basename(argv[0]))
-				+ " --mode [normal|cluster] [--n_pairs(1000) <pairs_amount> --seed(0) <the_seed>]>");
+				+ " --mode [normal|cluster] [--n_pairs(1000) <pairs_amount> --seed(0) <the_seed> --threads(cores) <count>"
+				+ " --distribution(<mode>) [uniform|boxes|hotspots|trips] --profile(default) <name>"
+				+ " --output(<mode>.json) <path|-> --answers(<output>.answers.f64) <path>]");
   Config config;
   const static option long_options[] = {
     {"n_pairs", required_argument, 0, 'n'},
     {"seed", required_argument, 0, 's'},
     {"mode", required_argument, 0, 'm'},
+    {"threads", required_argument, 0, 't'},
+    {"output", required_argument, 0, 'o'},
+    {"answers", required_argument, 0, 'a'},
+    {"distribution", required_argument, 0, 'd'},
+    {"profile", required_argument, 0, 'p'},
     {0, 0, 0, 0}
   };
   int option_index = 0;
   int c = 0;
   while (true) {
-    c = getopt_long(argc, argv, "n:s:m:h", long_options, &option_index);
+    c = getopt_long(argc, argv, "n:s:m:t:o:a:d:p:h", long_options, &option_index);
     if (c == -1)
       break;
     switch (c) {
-    case 'n': config.n_pairs_to_generate = std::stod(optarg); break;
+    case 'n': config.n_pairs_to_generate = parse_pair_count(optarg); break;
     case 's': config.seed = std::stoul(optarg); break;
     case 'm': {
       config.mode = get_op_mode(optarg);
     } break;
+    case 't': config.n_threads = std::max(1, std::stoi(optarg)); break;
+    case 'o': config.output_path = optarg; break;
+    case 'a': config.answers_path = optarg; break;
+    case 'd': config.distribution = get_distribution(optarg); break;
+    case 'p': config.profile = get_profile(optarg); break;
     default: {
       
     }
@@ -78,6 +205,13 @@ Config parse_command_line(int argc, char **argv) {
   }
   if (config.mode == eOperatingMode::Null)
     throw std::invalid_argument("Operating mode can be only one of these two: [normal, cluster]");
+  if (config.distribution == eDistribution::Default)
+    config.distribution = (config.mode == eOperatingMode::Normal) ? eDistribution::Uniform : eDistribution::Boxes;
+  if (config.output_path.empty())
+    config.output_path = (config.mode == eOperatingMode::Normal) ? "normal.json" : "cluster.json";
+  // NOTE: a stream to stdout has no answers file unless one is asked for.
+  if (config.answers_path.empty() && config.output_path != "-")
+    config.answers_path = config.output_path + ".answers.f64";
   return config;
 }
 
@@ -95,7 +229,7 @@ static double Square(double A) {
 }
 
 static double RadiansFromDegrees(double Degrees) {
-  double Result = 0.01745329251994329577f * Degrees;
+  double Result = 0.01745329251994329577 * Degrees;
   return Result;
 }
 
@@ -114,251 +248,447 @@ static double ReferenceHaversine(double X0, double Y0, double X1, double Y1, dou
   return Result;
 }
 
-int normal_mode_part(std::array<PointPair, 1000> &pairs, int n_generated, int n_total, std::default_random_engine &re) {
-  static std::uniform_real_distribution<double> xg(-180.0d, 180.0d);
-  static std::uniform_real_distribution<double> yg(-1.0d, 1.0d);
-  int n = 0;
-  for (; n < std::min(n_total - n_generated, 1000); n++) {
-    PointPair pp;
-    pp.first.x = xg(re);
-    pp.first.y = asin(yg(re));
-    pp.second.x = xg(re);
-    pp.second.y = asin(yg(re));
-    pairs[n] = pp;
+// Counter-based generator (SplitMix64 run on a counter): the n-th value of a
+// stream is a hash of the key and n, so a thread can start anywhere in the
+// sequence without generating what comes before. Every pair gets its own key
+// in each of two streams, the geometry stream for its points and the layout
+// stream for its formatting choices, which is what keeps the output identical
+// for any thread count. Since no two pairs share a key, a pair can draw as
+// many values as it needs without touching the values of any other pair.
+constexpr uint64_t SPLITMIX_GAMMA = 0x9e3779b97f4a7c15ull;
+constexpr uint64_t GEOMETRY_STREAM = 0;
+constexpr uint64_t LAYOUT_STREAM = 1;
+constexpr uint64_t PAIRS_PER_BATCH = 16384;
+
+struct CounterRng {
+  uint64_t key;
+  uint64_t counter;
+};
+
+static uint64_t mix64(uint64_t z) {
+  z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+  z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+  return z ^ (z >> 31);
+}
+
+static CounterRng make_rng(unsigned long seed, uint64_t stream, uint64_t pair_index) {
+  const uint64_t stream_key = mix64(seed + (stream + 1) * SPLITMIX_GAMMA);
+  return CounterRng{mix64(stream_key + (pair_index + 1) * SPLITMIX_GAMMA), 0};
+}
+
+static uint64_t next_bits(CounterRng &rng) {
+  return mix64(rng.key + (rng.counter++) * SPLITMIX_GAMMA);
+}
+
+static double uniform(CounterRng &rng, double lo, double hi) {
+  const double unit = (next_bits(rng) >> 11) * 0x1.0p-53;
+  return lo + (hi - lo) * unit;
+}
+
+// NOTE: modulo bias is far below anything a benchmark input could show.
+static int pick(CounterRng &rng, int count) {
+  return (int)(next_bits(rng) % (uint64_t)count);
+}
+
+// Box-Muller; the first uniform is moved to (0, 1] so the log stays finite.
+static double gaussian(CounterRng &rng) {
+  const double u = 1.0 - uniform(rng, 0.0, 1.0);
+  const double v = uniform(rng, 0.0, 1.0);
+  return sqrt(-2.0 * log(u)) * cos(2.0 * M_PI * v);
+}
+
+static double wrap_longitude(double x) {
+  while (x >= 180.0)
+    x -= 360.0;
+  while (x < -180.0)
+    x += 360.0;
+  return x;
+}
+
+static PointPair normal_pair(CounterRng &rng) {
+  PointPair pp;
+  pp.first.x = uniform(rng, -180.0, 180.0);
+  pp.first.y = asin(uniform(rng, -1.0, 1.0));
+  pp.second.x = uniform(rng, -180.0, 180.0);
+  pp.second.y = asin(uniform(rng, -1.0, 1.0));
+  return pp;
+}
+
+struct Cluster {
+  double x0, x1, y0, y1;
+};
+
+static const Cluster clusters[] = {
+  {10, 30, -20, -10},
+  {5, 15, -2, 10},
+  {80, 120, 20, 40},
+  {-90, -75, -90, -70},
+  {-60, -5, 0, 20},
+  {-6, -1, 55, 60},
+  {-180, -65, 33, 40},
+  {75, 80, -30, 30},
+  {-140, -15, 50, 55},
+  {150, 155, 0, 20},
+  {-77, 77, -77, 77},
+  {-160, -152, -90, -70},
+};
+constexpr uint64_t CLUSTER_COUNT = sizeof(clusters) / sizeof(clusters[0]);
+
+static PointPair cluster_pair(CounterRng &rng, uint64_t pair_index) {
+  const Cluster &c = clusters[pair_index % CLUSTER_COUNT];
+  PointPair pp;
+  pp.first.x = uniform(rng, c.x0, c.x1);
+  pp.first.y = uniform(rng, c.y0, c.y1);
+  pp.second.x = uniform(rng, c.x0, c.x1);
+  pp.second.y = uniform(rng, c.y0, c.y1);
+  return pp;
+}
+
+// Metro areas with a rough relative weight and spread (degrees), for data
+// that piles up where people are, the way real location feeds do.
+struct Hotspot {
+  double x, y, spread, weight;
+};
+
+static const Hotspot hotspots[] = {
+  {139.69, 35.69, 0.6, 37.4},  // Tokyo
+  {77.21, 28.61, 0.5, 32.9},   // Delhi
+  {121.47, 31.23, 0.5, 29.2},  // Shanghai
+  {-46.63, -23.55, 0.5, 22.6}, // Sao Paulo
+  {-99.13, 19.43, 0.4, 21.9},  // Mexico City
+  {31.24, 30.04, 0.3, 21.3},   // Cairo
+  {72.88, 19.08, 0.3, 20.9},   // Mumbai
+  {116.41, 39.90, 0.5, 20.5},  // Beijing
+  {90.41, 23.81, 0.2, 21.7},   // Dhaka
+  {-74.01, 40.71, 0.7, 18.8},  // New York
+  {3.38, 6.52, 0.3, 15.4},     // Lagos
+  {-58.38, -34.60, 0.4, 15.2}, // Buenos Aires
+  {37.62, 55.76, 0.6, 12.6},   // Moscow
+  {-0.13, 51.51, 0.5, 9.5},    // London
+  {2.35, 48.86, 0.4, 11.1},    // Paris
+  {-118.24, 34.05, 0.8, 12.5}, // Los Angeles
+  {151.21, -33.87, 0.5, 5.4},  // Sydney
+  {18.42, -33.92, 0.3, 4.8},   // Cape Town
+};
+constexpr int HOTSPOT_COUNT = sizeof(hotspots) / sizeof(hotspots[0]);
+
+static Point hotspot_point(CounterRng &rng) {
+  static const auto cumulative = [] {
+    std::vector<double> result;
+    double total = 0;
+    for (const auto &h : hotspots)
+      result.push_back(total += h.weight);
+    return result;
+  }();
+  const double target = uniform(rng, 0.0, cumulative.back());
+  int i = 0;
+  while (i + 1 < HOTSPOT_COUNT && cumulative[i] <= target)
+    i++;
+  const Hotspot &h = hotspots[i];
+  Point p;
+  p.x = wrap_longitude(h.x + h.spread * gaussian(rng));
+  p.y = std::clamp(h.y + h.spread * gaussian(rng), -90.0, 90.0);
+  return p;
+}
+
+// Both ends in (usually different) metro areas: long-haul, heavily clumped.
+static PointPair hotspot_pair(CounterRng &rng) {
+  PointPair pp;
+  pp.first = hotspot_point(rng);
+  pp.second = hotspot_point(rng);
+  return pp;
+}
+
+// A start in a metro area and an end a short trip away, as in ride or
+// delivery logs: most distances are a few km, with a long exponential tail.
+static PointPair trip_pair(CounterRng &rng) {
+  constexpr double MEAN_TRIP_KM = 8.0;
+  constexpr double EARTH_RADIUS_KM = 6372.8;
+  PointPair pp;
+  pp.first = hotspot_point(rng);
+  const double distance = -MEAN_TRIP_KM * log(1.0 - uniform(rng, 0.0, 1.0));
+  const double bearing = uniform(rng, 0.0, 2.0 * M_PI);
+  const double d = distance / EARTH_RADIUS_KM;
+  const double lat1 = RadiansFromDegrees(pp.first.y);
+  const double lon1 = RadiansFromDegrees(pp.first.x);
+  const double lat2 = asin(sin(lat1) * cos(d) + cos(lat1) * sin(d) * cos(bearing));
+  const double lon2 = lon1 + atan2(sin(bearing) * sin(d) * cos(lat1), cos(d) - sin(lat1) * sin(lat2));
+  pp.second.x = wrap_longitude(lon2 * 180.0 / M_PI);
+  pp.second.y = lat2 * 180.0 / M_PI;
+  return pp;
+}
+
+static PointPair generate_pair(const Config &config, uint64_t pair_index) {
+  CounterRng rng = make_rng(config.seed, GEOMETRY_STREAM, pair_index);
+  switch (config.distribution) {
+  case eDistribution::Boxes: return cluster_pair(rng, pair_index);
+  case eDistribution::Hotspots: return hotspot_pair(rng);
+  case eDistribution::Trips: return trip_pair(rng);
+  default: return normal_pair(rng);
   }
-  return n;
 }
 
-void normal_mode(std::default_random_engine &re, std::array<PointPair, 1000> &pairs, int n_total, const std::string &output_filename) {
-  int n_generated = 0;
+// Collects output in large blocks and hands them to write(2) directly.
+class BlockWriter {
+public:
+  static constexpr size_t BLOCK_SIZE = 1 << 20;
+
+  // "-" is stdout. An empty filename makes a writer that drops everything.
+  explicit BlockWriter(const std::string &filename) : filename(filename) {
+    if (filename.empty())
+      return;
+    fd = (filename == "-") ? dup(STDOUT_FILENO) : open(filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+      throw std::runtime_error("can't create/open a file " + filename);
+    block.reserve(BLOCK_SIZE);
+  }
 
-  std::ofstream f(output_filename);
-  std::ofstream ff(output_filename + ".answers.f64", std::ios_base::out);
-  if (f.bad() || !f.is_open())
-    throw std::runtime_error("can't create/open a file " + output_filename);
-  f << std::setw(24) << std::fixed;
-  if (ff.bad() || !ff.is_open())
-    throw std::runtime_error("can't create/open an answer file " + output_filename);
-  double hav_avg = 0;
-  f << "{\"pairs\":[\n";
-  for (int i = 0; i + 1000 < n_total; i += 1000) {
-    const auto iteration_gen= normal_mode_part(pairs, i, n_total, re);
-    for (int j = 0; j < iteration_gen; j++) {
-      const auto &p = pairs[j];
-      const auto &p0 = p.first;
-      const auto &p1 = p.second;
-      const auto res = ReferenceHaversine(p0.x, p0.y, p1.x, p1.y);
-      f << "\t{\"x0\":" << p0.x << ", \"y0\":" << p0.y << ", ";
-      f << "\"x1\":"  << p1.x << ", \"y1\":" << p1.y
-        << ", \"answer\":" << res << "}";
-      if (iteration_gen + n_generated - 1 != n_total) f << ',';
-      f << '\n';
-      const auto result = (res / n_total);
-      ff.write(reinterpret_cast<const char *>(&res), sizeof(double));
-      hav_avg += result;
-    }
-    n_generated += iteration_gen;
+  ~BlockWriter() {
+    if (fd >= 0)
+      close(fd);
+  }
+
+  void append(const char *data, size_t size) {
+    if (fd < 0)
+      return;
+    if (block.size() + size > BLOCK_SIZE)
+      flush();
+    if (size >= BLOCK_SIZE)
+      write_all(data, size);
+    else
+      block.append(data, size);
   }
-  if (n_generated != n_total) {
-    const auto iteration_gen= normal_mode_part(pairs, n_generated, n_total, re);
-    for (int j = 0; j < iteration_gen; j++) {
-      const auto &p = pairs[j];
-      const auto &p0 = p.first;
-      const auto &p1 = p.second;
-      const auto res = ReferenceHaversine(p0.x, p0.y, p1.x, p1.y);
-      f << "\t{\"x0\":" << p0.x << ", \"y0\":" << p0.y << ", ";
-      f << "\"x1\":"  << p1.x << ", \"y1\":" << p1.y << ", \"answer\":"
-        << res
-        << "}";
-      if (iteration_gen - 1 != j) f << ',';
-      f << '\n';
-      const auto result = (res / n_total);
-      ff.write(reinterpret_cast<const char *>(&res), sizeof(double));
-      hav_avg += result;
+
+  void append(const std::string &text) { append(text.data(), text.size()); }
+
+  void flush() {
+    if (fd < 0)
+      return;
+    write_all(block.data(), block.size());
+    block.clear();
+  }
+
+private:
+  void write_all(const char *data, size_t size) {
+    while (size) {
+      const ssize_t written = write(fd, data, size);
+      if (written < 0 && errno == EINTR)
+        continue;
+      if (written <= 0)
+        throw std::runtime_error("can't write to " + filename + ": " + strerror(written < 0 ? errno : EIO));
+      data += written;
+      size -= written;
     }
   }
-  f << "]}\n";
-  std::cout << "ReferenceHaversine avg: " << hav_avg << std::endl;
-  ff.write(reinterpret_cast<const char *>(&hav_avg), sizeof(double));
-  return;
+
+  std::string filename;
+  std::string block;
+  int fd = -1;
+};
+
+// Numbers are printed with std::to_chars, with no locale or stream state
+// involved. Every style reads back as exactly the same double (17 significant
+// digits are always enough), so the JSON holds the very values the answers
+// were computed from.
+static void append_number(std::string &out, double value, eNumberStyle style, CounterRng &layout) {
+  if (style == eNumberStyle::Mixed)
+    style = (eNumberStyle)pick(layout, (int)eNumberStyle::Mixed);
+  char digits[32];
+  char *end = digits;
+  switch (style) {
+  case eNumberStyle::Long:
+    end = std::to_chars(digits, digits + sizeof(digits), value, std::chars_format::general, 17).ptr;
+    break;
+  case eNumberStyle::Scientific:
+    end = std::to_chars(digits, digits + sizeof(digits), value, std::chars_format::scientific).ptr;
+    break;
+  case eNumberStyle::UpperScientific:
+    end = std::to_chars(digits, digits + sizeof(digits), value, std::chars_format::scientific).ptr;
+    for (char *c = digits; c != end; c++)
+      if (*c == 'e')
+        *c = 'E';
+    break;
+  default:
+    end = std::to_chars(digits, digits + sizeof(digits), value).ptr;
+    break;
+  }
+  out.append(digits, end);
 }
 
-static std::uniform_real_distribution<double> gxg[12];
-static std::uniform_real_distribution<double> gyg[12];
-void init_cluster_arr() {
-  int i = 0;
-  double x0 = 10;
-  double x1 = 30;
-  double y0 = -20;
-  double y1 = -10;
-  gxg[i] = std::uniform_real_distribution<double>(x0, x1);
-  gyg[i] = std::uniform_real_distribution<double>(y0, y1);
-
-  i = 1;
-  x0 = 5;
-  x1 = 15;
-  y0 = -2;
-  y1 = 10;
-  gxg[i] = std::uniform_real_distribution<double>(x0, x1);
-  gyg[i] = std::uniform_real_distribution<double>(y0, y1);
-
-  i = 2;
-  x0 = 80;
-  x1 = 120;
-  y0 = 20;
-  y1 = 40;
-  gxg[i] = std::uniform_real_distribution<double>(x0, x1);
-  gyg[i] = std::uniform_real_distribution<double>(y0, y1);
-
-  i = 3;
-  x0 = -90;
-  x1 = -75;
-  y0 = -90;
-  y1 = -70;
-  gxg[i] = std::uniform_real_distribution<double>(x0, x1);
-  gyg[i] = std::uniform_real_distribution<double>(y0, y1);
-
-  i = 4;
-  x0 = -60;
-  x1 = -5;
-  y0 = 0;
-  y1 = 20;
-  gxg[i] = std::uniform_real_distribution<double>(x0, x1);
-  gyg[i] = std::uniform_real_distribution<double>(y0, y1);
-
-  i = 5;
-  x0 = -6;
-  x1 = -1;
-  y0 = 55;
-  y1 = 60;
-  gxg[i] = std::uniform_real_distribution<double>(x0, x1);
-  gyg[i] = std::uniform_real_distribution<double>(y0, y1);
-
-  i = 6;
-  x0 = -180;
-  x1 = -65;
-  y0 = 33;
-  y1 = 40;
-  gxg[i] = std::uniform_real_distribution<double>(x0, x1);
-  gyg[i] = std::uniform_real_distribution<double>(y0, y1);
-
-  i = 7;
-  x0 = 75;
-  x1 = 80;
-  y0 = -30;
-  y1 = 30;
-  gxg[i] = std::uniform_real_distribution<double>(x0, x1);
-  gyg[i] = std::uniform_real_distribution<double>(y0, y1);
-
-  i = 8;
-  x0 = -140;
-  x1 = -15;
-  y0 = 50;
-  y1 = 55;
-  gxg[i] = std::uniform_real_distribution<double>(x0, x1);
-  gyg[i] = std::uniform_real_distribution<double>(y0, y1);
-
-  i = 9;
-  x0 = 150;
-  x1 = 155;
-  y0 = 0;
-  y1 = 20;
-  gxg[i] = std::uniform_real_distribution<double>(x0, x1);
-  gyg[i] = std::uniform_real_distribution<double>(y0, y1);
-
-  i = 10;
-  x0 = -77;
-  x1 = 77;
-  y0 = -77;
-  y1 = 77;
-  gxg[i] = std::uniform_real_distribution<double>(x0, x1);
-  gyg[i] = std::uniform_real_distribution<double>(y0, y1);
-
-  i = 11;
-  x0 = -160;
-  x1 = -152;
-  y0 = -90;
-  y1 = -70;
-  gxg[i] = std::uniform_real_distribution<double>(x0, x1);
-  gyg[i] = std::uniform_real_distribution<double>(y0, y1);  
-}
-
-int cluster_mode_part(std::array<PointPair, 1000> &pairs, int n_generated, int n_total, std::default_random_engine &re) {
-  int n = 0;
-  for (; n < std::min(n_total - n_generated, 1000); n++) {
-    PointPair pp;
-    const int i = n % 12;
-    pp.first.x = gxg[i](re);
-    pp.first.y = gyg[i](re);
-    pp.second.x = gxg[i](re);
-    pp.second.y = gyg[i](re);
-    pairs[n] = pp;
+// Random runs of JSON whitespace, for the spacing a producer's pretty printer
+// or a hand edit leaves behind. Usually nothing, sometimes several bytes.
+static void append_space(std::string &out, const Profile &profile, CounterRng &layout) {
+  if (profile.spacing != eSpacing::Random)
+    return;
+  static const char whitespace[] = " \t\r\n";
+  const int count = std::max(0, pick(layout, 8) - 4);
+  for (int i = 0; i < count; i++)
+    out += whitespace[pick(layout, 4)];
+}
+
+struct SpacingText {
+  const char *header, *footer;
+  const char *pair_open, *pair_close, *field_sep, *colon, *newline;
+};
+
+static const SpacingText &spacing_text(eSpacing spacing) {
+  static const SpacingText lines = {"{\"pairs\":[\n", "]}\n", "\t{", "}", ", ", ":", "\n"};
+  static const SpacingText tight = {"{\"pairs\":[", "]}", "{", "}", ",", ":", ""};
+  static const SpacingText pretty = {"{\n  \"pairs\": [\n", "  ]\n}\n", "    {\n      ", "\n    }", ",\n      ", ": ", "\n"};
+  switch (spacing) {
+  case eSpacing::Lines: return lines;
+  case eSpacing::Pretty: return pretty;
+  default: return tight;
   }
-  return n;
-}
-
-void cluster_mode(std::default_random_engine &re, std::array<PointPair, 1000> &pairs, int n_total, const std::string &output_filename) {
-  init_cluster_arr();
-  int n_generated = 0;
-  std::ofstream f(output_filename);
-  std::ofstream ff(output_filename + ".answers.f64", std::ios_base::out);
-  if (f.bad() || !f.is_open())
-    throw std::runtime_error("can't create/open a file " + output_filename);
-  if (ff.bad() || !ff.is_open())
-    throw std::runtime_error("can't create/open an answer file " + output_filename);
-  double hav_avg = 0;
-  f << "{\"pairs\":[\n";
-  for (int i = 0; i + 1000 < n_total; i += 1000) {
-    const auto iteration_gen= cluster_mode_part(pairs, i, n_total, re);
-    for (int j = 0; j < iteration_gen; j++) {
-      const auto &p = pairs[j];
-      const auto &p0 = p.first;
-      const auto &p1 = p.second;      
-      f << "\t{\"x0\":" << p0.x << ", \"y0\":" << p0.y << ", ";
-      f << "\"x1\":"  << p1.x << ", \"y1\":" << p1.y << "}";
-      if (iteration_gen + n_generated - 1 != n_total) f << ',';
-      f << '\n';
-      const auto res = ReferenceHaversine(p0.x, p0.y, p1.x, p1.y) ;
-      const auto result = (res / n_total);
-      ff.write(reinterpret_cast<const char *>(&res), sizeof(double));
-      hav_avg += result;
+}
+
+// Fields the parser has to skip: scalars, a string with escapes, an array,
+// and an object nested `profile.nesting` levels deep.
+static const char *const extra_keys[] = {"id", "meta", "tag", "flags", "note", "seq", "src", "ts"};
+constexpr int MAX_EXTRA_FIELDS = sizeof(extra_keys) / sizeof(extra_keys[0]);
+
+static void append_extra(std::string &out, int extra, uint64_t pair_index, const Profile &profile) {
+  switch (extra % 4) {
+  case 0: out += std::to_string(pair_index); break;
+  case 1: {
+    for (int level = 0; level < profile.nesting; level++)
+      out += "{\"v\":";
+    out += "{\"ok\":true,\"w\":[1,2.5e-3,null],\"x0\":\"not a coordinate\"}";
+    for (int level = 0; level < profile.nesting; level++)
+      out += '}';
+  } break;
+  case 2: out += "\"stop \\\"7\\\"\\n\\u00e9\\/\\\\\""; break;
+  default: out += "[true,false,null,\"\",{}]"; break;
+  }
+}
+
+struct Field {
+  const char *key;
+  double value;
+  int extra; // -1 for the coordinates and the answer
+};
+
+static void append_pair(std::string &out, const Config &config, uint64_t pair_index, const PointPair &p, double answer) {
+  const Profile &profile = *config.profile;
+  const SpacingText &text = spacing_text(profile.spacing);
+  CounterRng layout = make_rng(config.seed, LAYOUT_STREAM, pair_index);
+
+  Field fields[5 + MAX_EXTRA_FIELDS] = {
+    {"x0", p.first.x, -1}, {"y0", p.first.y, -1}, {"x1", p.second.x, -1}, {"y1", p.second.y, -1},
+  };
+  int count = 4;
+  if (config.mode == eOperatingMode::Normal)
+    fields[count++] = {"answer", answer, -1};
+  for (int extra = 0; extra < profile.extra_fields; extra++)
+    fields[count++] = {extra_keys[extra], 0, extra};
+  if (profile.shuffle_keys)
+    for (int i = count - 1; i > 0; i--)
+      std::swap(fields[i], fields[pick(layout, i + 1)]);
+
+  out += text.pair_open;
+  for (int i = 0; i < count; i++) {
+    if (i) {
+      out += text.field_sep;
+      append_space(out, profile, layout);
     }
-    n_generated += iteration_gen;
+    out += '"';
+    out += fields[i].key;
+    out += '"';
+    append_space(out, profile, layout);
+    out += text.colon;
+    append_space(out, profile, layout);
+    if (fields[i].extra < 0)
+      append_number(out, fields[i].value, profile.numbers, layout);
+    else
+      append_extra(out, fields[i].extra, pair_index, profile);
+    append_space(out, profile, layout);
+  }
+  out += text.pair_close;
+  if (pair_index + 1 != config.n_pairs_to_generate) out += ',';
+  out += text.newline;
+  append_space(out, profile, layout);
+}
+
+// A run of consecutive pairs, generated and formatted by one thread.
+struct Batch {
+  uint64_t first = 0;
+  uint64_t count = 0;
+  std::string text;
+  std::vector<double> answers;
+};
+
+static void generate_batch(const Config &config, Batch &batch) {
+  std::string &out = batch.text;
+  out.reserve((size_t)batch.count * 128);
+  batch.answers.resize(batch.count);
+  for (uint64_t j = 0; j < batch.count; j++) {
+    const uint64_t pair_index = batch.first + j;
+    const PointPair p = generate_pair(config, pair_index);
+    const auto res = ReferenceHaversine(p.first.x, p.first.y, p.second.x, p.second.y);
+    append_pair(out, config, pair_index, p, res);
+    batch.answers[j] = res;
+  }
+}
+
+// Generates the batches of one round, one thread each, starting at pair `first`.
+static std::vector<std::thread> start_round(const Config &config, std::vector<Batch> &batches, uint64_t first) {
+  std::vector<std::thread> threads;
+  for (auto &batch : batches) {
+    batch.first = first;
+    batch.count = std::min<uint64_t>(config.n_pairs_to_generate - std::min(first, config.n_pairs_to_generate), PAIRS_PER_BATCH);
+    first += batch.count;
+    batch.text.clear();
+    batch.answers.clear();
+    if (batch.count)
+      threads.emplace_back(generate_batch, std::cref(config), std::ref(batch));
   }
-  if (n_generated != n_total) {
-    const auto iteration_gen= cluster_mode_part(pairs, n_generated, n_total, re);
-    for (int j = 0; j < iteration_gen; j++) {
-      const auto &p = pairs[j];
-      const auto &p0 = p.first;
-      const auto &p1 = p.second;      
-      f << "\t{\"x0\":" << p0.x << ", \"y0\":" << p0.y << ", ";
-      f << "\"x1\":"  << p1.x << ", \"y1\":" << p1.y << "}";
-      if (iteration_gen - 1 != j) f << ',';
-      f << '\n';
-      const auto res = ReferenceHaversine(p0.x, p0.y, p1.x, p1.y);
-      const auto result = (res / n_total);
-      ff.write(reinterpret_cast<const char *>(&res), sizeof(double));
-      hav_avg += result;
+  return threads;
+}
+
+// NOTE: the next round is generated while the current one is written out, and
+// the average is accumulated in pair order, so only the writing is serial.
+void generate(const Config &config) {
+  const uint64_t n_total = config.n_pairs_to_generate;
+  BlockWriter f(config.output_path);
+  BlockWriter ff(config.answers_path);
+
+  std::vector<Batch> current(config.n_threads), next(config.n_threads);
+  const uint64_t round_size = (uint64_t)config.n_threads * PAIRS_PER_BATCH;
+  for (auto &t : start_round(config, current, 0))
+    t.join();
+
+  double hav_avg = 0;
+  const SpacingText &text = spacing_text(config.profile->spacing);
+  f.append(text.header, strlen(text.header));
+  for (uint64_t first = 0; first < n_total; first += round_size) {
+    auto threads = start_round(config, next, first + round_size);
+    for (const auto &batch : current) {
+      f.append(batch.text);
+      ff.append(reinterpret_cast<const char *>(batch.answers.data()), batch.answers.size() * sizeof(double));
+      for (const auto res : batch.answers)
+        hav_avg += res / n_total;
     }
+    for (auto &t : threads)
+      t.join();
+    std::swap(current, next);
   }
-  f << "]}\n";
-  std::cout << "ReferenceHaversine avg: " << hav_avg << std::endl;
-  return;
+  f.append(text.footer, strlen(text.footer));
+  f.flush();
+  // NOTE: the answers file always ends with the average, in both modes.
+  ff.append(reinterpret_cast<const char *>(&hav_avg), sizeof(double));
+  ff.flush();
+  log_stream(config) << "ReferenceHaversine avg: " << hav_avg << std::endl;
 }
 
 int main(int argc, char **argv) try {
   const Config config = parse_command_line(argc, argv);
-  std::cout << "Config: " << config << std::endl;
-
-  std::array<PointPair, 1000> generated_pairs;
-  std::default_random_engine re(config.seed);
-  if (config.mode == eOperatingMode::Normal) {
-    normal_mode(re, generated_pairs, config.n_pairs_to_generate, "normal.json");
-  } else if (config.mode == eOperatingMode::Cluster) {
-    cluster_mode(re, generated_pairs, config.n_pairs_to_generate, "cluster.json");
-  }
+  log_stream(config) << "Config: " << config << std::endl;
+  generate(config);
   return 0;
 } catch (const std::invalid_argument &ia) {
   std::cout << ia.what() << std::endl;
   return 1;
+} catch (const std::runtime_error &re) {
+  std::cerr << re.what() << std::endl;
+  return 1;
 }